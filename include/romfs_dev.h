@@ -9,7 +9,14 @@
  */
 #pragma once
 
+#ifdef ROMFS_FORMAT_ONLY
+// host tools only use the image format definitions
+#include <stdint.h>
+#else
+#include <coreinit/filesystem_fsa.h>
+#include <dirent.h>
 #include <wut.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -52,26 +59,131 @@ typedef struct {
     uint8_t name[];    ///< Name. (UTF-8)
 } romfs_file;
 
+#ifndef ROMFS_FORMAT_ONLY
+
 typedef enum {
     RomfsSource_FileDescriptor,
     RomfsSource_FileDescriptor_CafeOS,
+    RomfsSource_Backend,  ///< Application provided backend, only used by romfsMountFromBackend.
+    RomfsSource_Embedded, ///< Image linked into the application, only used by romfsMountEmbedded.
 } RomfsSource;
 
 /**
  * @brief Mounts the Application's RomFS.
  * @param name Device mount name.
+ * @return Like romfsMountEx.
  */
 int32_t romfsMount(const char *name, const char *path, RomfsSource source);
 
+/// Flags for romfsMountEx.
+typedef enum {
+    RomfsMountFlag_None             = 0,
+    RomfsMountFlag_Lazy             = 1 << 0, ///< Only read the header, load the metadata on first lookup.
+    RomfsMountFlag_LoadInBackground = 1 << 1, ///< Like RomfsMountFlag_Lazy, but start loading the metadata on a background thread right away.
+} RomfsMountFlags;
+
+/**
+ * @brief Mounts a RomFS image with additional options.
+ * With RomfsMountFlag_Lazy the header is validated and the device registered after a single small read.
+ * The metadata tables are loaded on first access, e.g. by open, stat or opendir.
+ * @param name Device mount name.
+ * @param flags Combination of RomfsMountFlags.
+ * @return 0 on success, -1 if path couldn't be opened, -8 if name is already mounted, -9 or -99 if out of memory,
+ * -10 if the image couldn't be read or is invalid.
+ */
+int32_t romfsMountEx(const char *name, const char *path, RomfsSource source, uint32_t flags);
+
 /**
- * @brief Mounts RomFS from an open file.
- * @param file FsFile of the RomFS image.
+ * @brief Mounts RomFS from an open file descriptor.
+ * The descriptor is not closed on unmount and must stay open until then.
+ * @param name Device mount name.
+ * @param fd File descriptor of the file containing the RomFS image.
  * @param offset Offset of the RomFS within the file.
+ * @return 0 on success, -1 if fd is invalid, otherwise like romfsMountEx.
+ */
+int32_t romfsMountFromFd(const char *name, int fd, uint64_t offset);
+
+/**
+ * @brief Mounts RomFS from a file opened with FSA.
+ * The handle is not closed on unmount and must stay open until then.
+ * @param name Device mount name.
+ * @param client FSA client that opened the file.
+ * @param handle FSA handle of the file containing the RomFS image.
+ * @param offset Offset of the RomFS within the file.
+ * @return 0 on success, otherwise like romfsMountEx.
+ */
+int32_t romfsMountFromFSAHandle(const char *name, FSAClientHandle client, FSAFileHandle handle, uint64_t offset);
+
+/**
+ * @brief Mounts a RomFS image stored in a file of another RomFS mount.
+ * Reads go through the parent mount and share its handles, nothing is extracted.
+ * The parent can be unmounted first, it stays open until the last nested mount is gone.
  * @param name Device mount name.
-bool romfsMountFromFile(FsFile file, uint64_t offset, const char *name);
-*/
+ * @param parentName Device mount name of the parent RomFS.
+ * @param path Path of the image inside the parent, e.g. "/plugins/foo.wuhb".
+ * @param offset Offset of the RomFS within that file.
+ * @return 0 on success, -2 if the parent was not found, -3 or -4 if path was not found, -5 if offset is past
+ * the end of the file, otherwise like romfsMountEx.
+ */
+int32_t romfsMountFromRomfs(const char *name, const char *parentName, const char *path, uint64_t offset);
+
+/**
+ * @brief Called by romfs_backend::readAsync once the read finished.
+ * @param result Number of bytes read, or a negative value on error.
+ */
+typedef void (*romfs_backend_done)(int64_t result, void *doneArg);
+
+/// Storage a RomFS image is read from. All functions may be called from several threads at once.
+typedef struct {
+    /// Reads size bytes at offset into buffer. Returns the number of bytes read, or a negative value on error.
+    int64_t (*readAt)(void *userdata, uint64_t offset, void *buffer, uint64_t size);
+    /// Optional. Starts a read and calls done from any thread once it finished. Returns false if the read wasn't started.
+    /// Used for prefetching, which keeps at most two reads in flight.
+    bool (*readAsync)(void *userdata, uint64_t offset, void *buffer, uint64_t size, romfs_backend_done done, void *doneArg);
+    /// Optional. Returns size bytes at offset that stay valid until close, or NULL to fall back to readAt.
+    const void *(*map)(void *userdata, uint64_t offset, uint64_t size);
+    /// Optional. Called once the mount is gone, or right away if mounting fails.
+    void (*close)(void *userdata);
+} romfs_backend;
+
+/**
+ * @brief Mounts a RomFS image read through application provided functions.
+ * Useful to put a custom cache or decompression layer below the driver.
+ * @param name Device mount name.
+ * @param backend Backend functions, copied by the call.
+ * @param userdata Passed to every backend function.
+ * @param offset Offset of the RomFS within the backend's storage.
+ * @return 0 on success, -1 if backend or its readAt is NULL, otherwise like romfsMountEx.
+ */
+int32_t romfsMountFromBackend(const char *name, const romfs_backend *backend, void *userdata, uint64_t offset);
+
+/// Marks directory entries in romfs_embedded::slots, the rest of the value is the dir table offset.
+#define ROMFS_EMBEDDED_DIR 0x80000000
+
+/// RomFS image linked into the application, generated by tools/romfs_embed.
+typedef struct {
+    const void *data;        ///< WUHB image, 4 byte aligned.
+    uint64_t size;           ///< Size of the image.
+    const uint32_t *seeds;   ///< Perfect hash displacement per bucket, NULL to look paths up through the hash tables.
+    uint32_t bucketCount;    ///< Number of seeds.
+    const uint32_t *slots;   ///< File table offset or ROMFS_EMBEDDED_DIR | dir table offset per slot, ~0 if unused.
+    uint32_t slotCount;      ///< Number of slots.
+} romfs_embedded;
 
-/// Unmounts the RomFS device.
+/**
+ * @brief Mounts a RomFS image linked into the application.
+ * Data and metadata are used in place, mounting does no I/O and allocates no tables.
+ * @param name Device mount name.
+ * @param image Image and lookup index, copied by the call. The arrays it points to must stay valid while mounted.
+ * @return 0 on success, -1 if the image or index is invalid, otherwise like romfsMountEx.
+ */
+int32_t romfsMountEmbedded(const char *name, const romfs_embedded *image);
+
+/**
+ * @brief Unmounts the RomFS device.
+ * The name is free again right away. Open files, directories and nested mounts keep the image open until they are closed.
+ * @return 0 on success, -1 if the mount was not found, -9 if out of memory.
+ */
 int32_t romfsUnmount(const char *name);
 
 /// RomFS file.
@@ -82,6 +194,242 @@ typedef struct {
 
 int romfsGetFileInfoPerPath(const char *romfs, const char *path, romfs_fileInfo *out);
 
+/**
+ * @brief Callback for romfsQuery.
+ * @param path Full path of the matching file, e.g. "/levels/1-1/textures/ground.bflim". Only valid during the call.
+ * @param info Location of the file within the image.
+ * @param userdata Pointer passed to romfsQuery.
+ * @return false to stop the query.
+ */
+typedef bool (*romfs_query_callback)(const char *path, const romfs_fileInfo *info, void *userdata);
+
+/**
+ * @brief Finds all files of a mount matching a glob pattern.
+ * Matching is case-insensitive and works on an index of all paths that is built on the first query,
+ * so no directories have to be opened. '*' and '?' match within a single path component,
+ * '**' matches any number of directories and [...] matches a character class.
+ * Only files are indexed. For example "**.bfres" finds every .bfres file and "/levels/stage[0-9].bin" the
+ * numbered stage files directly in /levels.
+ * The callback must not call other romfs functions.
+ * @param name Device mount name.
+ * @param pattern Glob pattern of the full path, a leading '/' is optional.
+ * @param callback Called once per match, in path order.
+ * @param userdata Passed to the callback.
+ * @return Number of matches passed to the callback, -1 if the mount was not found, -3 if the metadata is corrupt.
+ */
+int32_t romfsQuery(const char *name, const char *pattern, romfs_query_callback callback, void *userdata);
+
+/**
+ * @brief Like romfsQuery, but stores the results in an array.
+ * @param out Array receiving the file info of up to maxEntries matches.
+ * @param maxEntries Size of out.
+ * @return Total number of matches, which may be larger than maxEntries, or a negative value on error.
+ */
+int32_t romfsQueryFileInfo(const char *name, const char *pattern, romfs_fileInfo *out, uint32_t maxEntries);
+
+/**
+ * @brief Starts recording the open and read calls of a mount to a text log.
+ * Each line is "open <fileOff> <path>" or "read <fileOff> <pos> <size>". Lines are buffered and written in blocks.
+ * Pass the log to tools/romfs_reorder to store the file data in first-access order.
+ * @param name Device mount name.
+ * @param logPath File the log is written to, replaced if it exists.
+ * @return 0 on success, -1 if the mount was not found, -2 if the log couldn't be created, -3 if a trace is already running.
+ */
+int32_t romfsStartTrace(const char *name, const char *logPath);
+
+/**
+ * @brief Stops recording and closes the log. Unmounting stops the trace as well.
+ * @return 0 on success, -1 if the mount was not found or not traced, -2 if writing the log failed.
+ */
+int32_t romfsStopTrace(const char *name);
+
+/**
+ * @brief Progress callback for romfsExtract and romfsExtractToFd.
+ * @param bytesDone Number of bytes written so far.
+ * @param bytesTotal Number of bytes to write in total.
+ * @param userdata Pointer passed to the extract call.
+ * @return false to cancel the operation.
+ */
+typedef bool (*romfs_progress_callback)(uint64_t bytesDone, uint64_t bytesTotal, void *userdata);
+
+/**
+ * @brief Copies a file or a whole directory out of a RomFS mount.
+ * Files are read in large blocks in the order they are stored in the image while the
+ * previous block is being written, which is much faster than copying with fread/fwrite.
+ * @param romfsPath Source path including the mount name, e.g. "content:/data".
+ * @param destPath Destination file or directory. Missing parent directories are created.
+ * @param callback Optional progress callback, may be NULL.
+ * @param userdata Passed to the callback.
+ * @return 0 on success, -1 if the mount was not found, -2 if the path was not found,
+ * -3 on read errors, -4 on write errors, -5 if cancelled, -9 if out of memory.
+ */
+int32_t romfsExtract(const char *romfsPath, const char *destPath, romfs_progress_callback callback, void *userdata);
+
+/**
+ * @brief Copies a single file out of a RomFS mount into an open file descriptor.
+ * Writing starts at the current position of fd. See romfsExtract for the return values.
+ */
+int32_t romfsExtractToFd(const char *romfsPath, int fd, romfs_progress_callback callback, void *userdata);
+
+/// Access hints for romfsAdvise and romfsAdvisePath, modelled after posix_fadvise.
+typedef enum {
+    RomfsAdvice_Normal,     ///< No particular access pattern, no readahead. The default.
+    RomfsAdvice_Sequential, ///< The file is read front to back, data ahead of the current position is read in the background.
+    RomfsAdvice_Random,     ///< The file is read in random order, no readahead.
+    RomfsAdvice_WillNeed,   ///< The range will be needed soon and is loaded into the cache in the background.
+    RomfsAdvice_DontNeed,   ///< The range won't be needed again and is dropped from the cache.
+} RomfsAdvice;
+
+/**
+ * @brief Announces how an open RomFS file will be accessed.
+ * @param fd File descriptor of a file opened on a RomFS mount.
+ * @param offset Start of the range within the file, used by WillNeed and DontNeed.
+ * @param length Length of the range, 0 means until the end of the file.
+ * @param advice Access hint.
+ * @return 0 on success, -1 if fd is not a RomFS file, -3 if advice is invalid.
+ */
+int32_t romfsAdvise(int fd, uint64_t offset, uint64_t length, RomfsAdvice advice);
+
+/**
+ * @brief Like romfsAdvise, but for a file that isn't open.
+ * Only RomfsAdvice_WillNeed and RomfsAdvice_DontNeed are supported.
+ * @param romfsPath Path including the mount name, e.g. "content:/audio/bgm.ogg".
+ * @return 0 on success, -1 if the mount was not found, -2 if the file was not found, -3 if advice is invalid.
+ */
+int32_t romfsAdvisePath(const char *romfsPath, uint64_t offset, uint64_t length, RomfsAdvice advice);
+
+/// I/O priority classes, see romfsSetPriority.
+typedef enum {
+    RomfsPriority_High,   ///< Latency sensitive reads like audio or video streaming. Always served first and never split.
+    RomfsPriority_Normal, ///< Default for open files.
+    RomfsPriority_Low,    ///< Bulk loads. Never take the last free device slot. Used for extraction and background prefetching.
+} RomfsPriority;
+
+/**
+ * @brief Sets the I/O priority of an open RomFS file.
+ * Reads of all files on the same image are queued by priority. Normal reads are split into pieces of
+ * twice the read chunk size and Low reads into single chunks, so waiting High reads only wait for the
+ * current piece.
+ * @param fd File descriptor of a file opened on a RomFS mount.
+ * @param priority Priority of all further reads, including readahead.
+ * @return 0 on success, -1 if fd is not a RomFS file, -3 if priority is invalid.
+ */
+int32_t romfsSetPriority(int fd, RomfsPriority priority);
+
+/**
+ * @brief Loads the data of a file, or of every file below a directory, into memory and keeps it there.
+ * Reads of the pinned data are served from memory until romfsUnpin. Data is read in image order in large
+ * requests, files sharing their data are stored once. Metadata eviction keeps pinned data.
+ * @param romfsPath Path including the mount name, e.g. "content:/level1".
+ * @param background Return right away and load on the mount's cache thread at RomfsPriority_Low.
+ * Reads of data that isn't loaded yet wait for it.
+ * @return 0 on success, -1 if the mount was not found, -2 if the path was not found, -3 if the data doesn't fit
+ * the pin budget, -4 on read errors, -9 if out of memory.
+ */
+int32_t romfsPin(const char *romfsPath, bool background);
+
+/**
+ * @brief Releases data pinned by romfsPin for a file or every file below a directory.
+ * Other pinned files stay in memory, even if they were read in the same request. Files sharing their data
+ * are released together. Released data stays in the regular cache as long as it has room.
+ * @param romfsPath Path including the mount name, "content:/" releases everything.
+ * @return 0 on success, -1 if the mount was not found, -2 if the path was not found.
+ */
+int32_t romfsUnpin(const char *romfsPath);
+
+/**
+ * @brief Sets how much data romfsPin may keep in memory, on top of the cache size. Defaults to 16 MiB.
+ * Lowering it doesn't release data that is already pinned.
+ * @param name Device mount name.
+ * @param size Budget in bytes.
+ * @return 0 on success, -1 if the mount was not found.
+ */
+int32_t romfsSetPinBudget(const char *name, uint32_t size);
+
+/**
+ * @brief Sets how much memory the mount may use for data loaded ahead of time.
+ * Least recently used data is dropped first. Defaults to 4 MiB.
+ * @param name Device mount name.
+ * @param size Cache size in bytes.
+ * @return 0 on success, -1 if the mount was not found.
+ */
+int32_t romfsSetCacheSize(const char *name, uint32_t size);
+
+/**
+ * @brief Frees the metadata, path index and cached data of a mount while keeping it mounted. Pinned data stays.
+ * Everything is reloaded transparently on the next access. Open files and directories stay valid.
+ * @param name Device mount name, or NULL for all mounts that are not busy.
+ * @return 0 on success, -1 if the mount was not found, -2 if a lookup, query or extraction is using the metadata.
+ */
+int32_t romfsEvictMetadata(const char *name);
+
+/// Memory held by a mount, in bytes.
+typedef struct {
+    uint64_t metadata; ///< Hash and entry tables unless used in place, plus the missing-path filter. 0 while evicted.
+    uint64_t index;    ///< Path index used by romfsQuery.
+    uint64_t cache;    ///< Cached file data.
+    uint64_t pinned;   ///< File data pinned by romfsPin.
+    uint64_t total;    ///< Sum of the above.
+} romfs_memoryUsage;
+
+/**
+ * @brief Returns how much memory a mount currently holds.
+ * @param name Device mount name.
+ * @param out Receives the memory usage.
+ * @return 0 on success, -1 if the mount was not found or out is NULL.
+ */
+int32_t romfsGetMemoryUsage(const char *name, romfs_memoryUsage *out);
+
+/**
+ * @brief Sets the maximum size of a single read request issued to the storage.
+ * Nested mounts read through their parent and use its setting.
+ * @param name Device mount name.
+ * @param chunkSize Request size in bytes, must be a non-zero multiple of 0x40 up to 16 MiB. Defaults to 1 MiB.
+ * @return 0 on success, -1 if the mount was not found, -2 if chunkSize is invalid, -3 if the mount is nested.
+ */
+int32_t romfsSetReadChunkSize(const char *name, uint32_t chunkSize);
+
+/**
+ * @brief Enables or disables pipelined reads for RomfsSource_FileDescriptor_CafeOS mounts.
+ * When enabled (the default), reads spanning at least two chunks keep two requests in flight.
+ * Nested mounts read through their parent and use its setting.
+ * @param name Device mount name.
+ * @param enabled Whether large reads should be pipelined.
+ * @return 0 on success, -1 if the mount was not found, -3 if the mount is nested.
+ */
+int32_t romfsSetPipelinedReads(const char *name, bool enabled);
+
+/**
+ * @brief Sets how many FSA clients a RomfsSource_FileDescriptor_CafeOS mount may use.
+ * Every client has its own handle to the image, so reads from different threads can be
+ * in flight at the same time. Clients are opened on demand. Defaults to 2.
+ * @param name Device mount name.
+ * @param count Number of clients, between 1 and 16.
+ * @return 0 on success, -1 if the mount was not found, -2 if count is invalid, -3 if the mount is not a CafeOS mount,
+ * is nested or was made with romfsMountFromFSAHandle.
+ */
+int32_t romfsSetClientPoolSize(const char *name, uint32_t count);
+
+/**
+ * @brief Returns the position of the entry the next readdir returns, for romfsSeekDir.
+ * Positions are built from table offsets and stay valid while the image is mounted, for any handle of the same directory.
+ * @param dirp Directory opened with opendir on a RomFS mount.
+ * @param pos Receives the position.
+ * @return 0 on success, -1 if dirp is not a RomFS directory.
+ */
+int32_t romfsTellDir(DIR *dirp, uint64_t *pos);
+
+/**
+ * @brief Continues reading a directory at a position returned by romfsTellDir, without walking the entries before it.
+ * @param dirp Directory opened with opendir on a RomFS mount.
+ * @param pos Position returned by romfsTellDir for the same directory.
+ * @return 0 on success, -1 if dirp is not a RomFS directory, -2 if the metadata couldn't be loaded,
+ * -3 if pos is not a position in this directory.
+ */
+int32_t romfsSeekDir(DIR *dirp, uint64_t pos);
+
+#endif // ROMFS_FORMAT_ONLY
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,6 +4,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <malloc.h>
 #include <string.h>
 #include <sys/iosupport.h>
@@ -11,33 +14,182 @@
 #include <unistd.h>
 
 #include "romfs_dev.h"
+#include <algorithm>
+#include <condition_variable>
 #include <coreinit/debug.h>
 #include <mutex>
+#include <thread>
+
+#include <vector>
+
+#define ROMFS_DEFAULT_READ_CHUNK_SIZE  0x100000
+#define ROMFS_MAX_READ_CHUNK_SIZE      0x1000000
+#define ROMFS_DEFAULT_CLIENT_POOL_SIZE 2
+#define ROMFS_MAX_CLIENT_POOL_SIZE     16
+#define ROMFS_DEFAULT_CACHE_SIZE       0x400000
+#define ROMFS_EXTRACT_BLOCK_SIZE       0x400000
+#define ROMFS_EXTRACT_MAX_GAP          0x10000
+#define ROMFS_DEFAULT_PIN_BUDGET       0x1000000
+#define ROMFS_PIN_BLOCK_SIZE           0x400000
+#define ROMFS_PIN_MAX_GAP              0x1000
+#define ROMFS_TRACE_FLUSH_SIZE         0x10000
+#define ROMFS_DEFAULT_BACKEND_DEPTH    2
+#define ROMFS_PRIORITY_COUNT           3
+#define ROMFS_BLOOM_BITS_PER_ENTRY     12
+#define ROMFS_BLOOM_HASHES             6
+
+// romfsTellDir positions hold one of these in the upper and a table offset in the lower 32 bits
+#define ROMFS_DIRPOS_DOT               0
+#define ROMFS_DIRPOS_DOTDOT            1
+#define ROMFS_DIRPOS_DIR               2
+#define ROMFS_DIRPOS_FILE              3
+
+/// One FSA client with its own handle to the image.
+typedef struct romfs_fsa_slot {
+    FSAClientHandle client;
+    FSAFileHandle fd;
+} romfs_fsa_slot;
+
+/// Clients handed out to concurrent readers of a CafeOS mount.
+typedef struct romfs_fsa_pool {
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<romfs_fsa_slot> idle;
+    uint32_t open;
+    uint32_t target;
+    bool owned;
+} romfs_fsa_pool;
+
+/// Helper thread that keeps a second read in flight during large CafeOS reads.
+typedef struct romfs_pipeline {
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable cond;
+    bool running;
+    bool pending;
+    bool done;
+    bool busy;
+    romfs_fsa_slot slot;
+    void *buffer;
+    uint32_t size;
+    uint64_t pos;
+    FSError result;
+} romfs_pipeline;
+
+/// Orders the device requests of an image by priority.
+typedef struct romfs_io_sched {
+    std::mutex lock;
+    std::condition_variable cond;
+    uint32_t active;
+    uint32_t limit;
+    uint32_t waiting[ROMFS_PRIORITY_COUNT];
+} romfs_io_sched;
+
+/// Range of image data held in memory.
+typedef struct romfs_cache_entry {
+    uint64_t start;
+    uint64_t size;
+    uint8_t *data;
+    bool ready;
+    bool failed;
+    bool pinned;
+    uint32_t users;
+    uint64_t lastUse;
+    std::vector<uint64_t> pins; ///< Sorted starts of the blobs pinned in this entry, it stays pinned while any is left.
+} romfs_cache_entry;
+
+/// Range waiting to be loaded into the cache.
+typedef struct romfs_cache_job {
+    uint64_t start;
+    uint64_t size;
+    RomfsPriority priority;
+    romfs_cache_entry *entry; ///< Reserved pinned entry to fill, nullptr to allocate one.
+} romfs_cache_job;
+
+/// Prefetched image data of a mount, filled by a background thread.
+typedef struct romfs_cache {
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<romfs_cache_entry *> entries;
+    std::vector<romfs_cache_job> queue;
+    std::thread worker;
+    bool running;
+    uint32_t inflight;
+    uint64_t used;
+    uint64_t limit;
+    uint64_t pinned;
+    uint64_t pinLimit;
+    uint64_t useCounter;
+} romfs_cache;
+
+/// Full path of a file in the path index.
+typedef struct romfs_path_entry {
+    uint32_t pathOff;
+    uint32_t pathLen;
+    uint32_t fileOff;
+} romfs_path_entry;
+
+/// All file paths of a mount sorted case-insensitively, built on the first query.
+typedef struct romfs_path_index {
+    std::string paths;
+    std::vector<romfs_path_entry> entries;
+} romfs_path_index;
+
+/// Access log of a mount, see romfsStartTrace.
+typedef struct romfs_trace {
+    std::mutex lock;
+    int fd;
+    bool failed;
+    std::string buffer;
+} romfs_trace;
+
+/// Hash state of a folded absolute path, extended one component at a time.
+typedef struct romfs_path_hash {
+    uint32_t h1;
+    uint32_t h2;
+} romfs_path_hash;
 
 typedef struct romfs_mount {
     devoptab_t device;
-    bool setup;
     RomfsSource fd_type;
     int32_t id;
     int32_t fd;
     time_t mtime;
     uint64_t offset;
     romfs_header header;
-    romfs_dir *cwd;
+    uint32_t cwd;
     uint32_t *dirHashTable, *fileHashTable;
     void *dirTable, *fileTable;
     char name[32];
-    FSAFileHandle cafe_fd;
-    FSAClientHandle cafe_client;
-    OSMutex cafe_mutex;
+    OSMutex fd_mutex;
+    OSMutex meta_mutex;
+    char *path;
+    romfs_fsa_pool *pool;
+    struct romfs_mount *parent;
+    struct romfs_mount *nextShell; // next unused shell in romfs_free_shells
+    uint32_t refs;
+    uint32_t metaReaders;
+    bool metaValid;
+    bool borrowed;
+    uint32_t readChunkSize;
+    bool pipelined;
+    romfs_pipeline *pipeline;
+    romfs_cache *cache;
+    romfs_path_index *pathIndex;
+    romfs_backend backend;
+    void *backendData;
+    romfs_trace *trace;
+    romfs_io_sched *sched;
+    uint32_t *bloom;
+    uint32_t bloomMask;
+    romfs_path_hash cwdHash;
+    bool metaMapped;
+    romfs_embedded embedded;
 } romfs_mount;
 
 extern int __system_argc;
 extern char **__system_argv;
 
-//static char __thread __component[PATH_MAX+1];
-static char __component[PATH_MAX + 1];
-
 #define romFS_root(m)   ((romfs_dir *) (m)->dirTable)
 #define romFS_none      ((uint32_t) ~0)
 #define romFS_dir_mode  (S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH)
@@ -57,588 +209,3164 @@ static romfs_file *romFS_file(romfs_mount *mount, uint32_t off) {
     return curFile;
 }
 
-static ssize_t _romfs_read(romfs_mount *mount, uint64_t readOffset, void *buffer, uint64_t readSize) {
-    if (readSize == 0) {
-        return 0;
+static bool _romfsOpenSlot(const char *path, romfs_fsa_slot *slot) {
+    slot->client = FSAAddClient(nullptr);
+    if (slot->client == 0) {
+        OSReport("libromfs: FSAAddClient failed\n");
+        return false;
+    }
+    FSError result = FSAOpenFileEx(slot->client, path, "r", static_cast<FSMode>(0x666), FS_OPEN_FLAG_NONE, 0, &slot->fd);
+    if (result != FS_ERROR_OK) {
+        OSReport("libromfs: FSAOpenFileEx failed for %s. %s\n", path, FSAGetStatusStr(result));
+        FSADelClient(slot->client);
+        slot->client = 0;
+        return false;
     }
+    return true;
+}
 
-    uint64_t pos = mount->offset + readOffset;
-    if (mount->fd_type == RomfsSource_FileDescriptor) {
-        off_t seek_offset = lseek(mount->fd, pos, SEEK_SET);
-        if (seek_offset < 0 || (off_t) pos != seek_offset) {
-            return -1;
-        }
-        return read(mount->fd, buffer, readSize);
-    } else if (mount->fd_type == RomfsSource_FileDescriptor_CafeOS) {
-        FSError status;
-        uint32_t bytesRead = 0;
-
-        __attribute__((aligned(0x40))) uint8_t alignedBuffer[0x40];
-        uint64_t len = readSize;
-        void *ptr    = buffer;
-        while (bytesRead < len) {
-            // only use input buffer if cache-aligned and read size is a multiple of cache line size
-            // otherwise read into alignedBuffer
-            uint8_t *tmp = (uint8_t *) ptr;
-            size_t size  = len - bytesRead;
-
-            if (size < 0x40) {
-                // read partial cache-line back-end
-                tmp = alignedBuffer;
-            } else if ((uintptr_t) ptr & 0x3F) {
-                // read partial cache-line front-end
-                tmp  = alignedBuffer;
-                size = MIN(size, 0x40 - ((uintptr_t) ptr & 0x3F));
-            } else {
-                // read whole cache lines
-                size &= ~0x3F;
-            }
+static void _romfsCloseSlot(romfs_fsa_slot *slot) {
+    FSACloseFile(slot->client, slot->fd);
+    slot->fd = 0;
+    FSADelClient(slot->client);
+    slot->client = 0;
+}
 
-            // Limit each request to 1 MiB
-            if (size > 0x100000) {
-                size = 0x100000;
+// Hands out an idle client, opening another one while the pool is below its target size.
+// With wait == false this fails instead of blocking when every client is busy.
+static bool _romfsAcquireSlot(romfs_mount *mount, romfs_fsa_slot *out, bool wait) {
+    romfs_fsa_pool *pool = mount->pool;
+    std::unique_lock<std::mutex> lock(pool->lock);
+    while (pool->idle.empty()) {
+        if (pool->open < pool->target) {
+            pool->open++;
+            lock.unlock();
+            if (_romfsOpenSlot(mount->path, out)) {
+                return true;
+            }
+            lock.lock();
+            pool->open--;
+            // keep using the clients we already have
+            pool->target = MAX(pool->open, 1);
+            if (pool->open == 0) {
+                return false;
             }
+            continue;
+        }
+        if (!wait) {
+            return false;
+        }
+        pool->cond.wait(lock);
+    }
+    *out = pool->idle.back();
+    pool->idle.pop_back();
+    return true;
+}
 
-            status = FSAReadFileWithPos(mount->cafe_client, tmp, 1, size, pos, mount->cafe_fd, 0);
+static void _romfsReleaseSlot(romfs_mount *mount, romfs_fsa_slot *slot) {
+    romfs_fsa_pool *pool = mount->pool;
+    std::unique_lock<std::mutex> lock(pool->lock);
+    if (pool->open > pool->target) {
+        // the pool was shrunk while this client was in use
+        pool->open--;
+        lock.unlock();
+        _romfsCloseSlot(slot);
+        return;
+    }
+    pool->idle.push_back(*slot);
+    pool->cond.notify_one();
+}
 
-            if (status < 0) {
-                if (bytesRead != 0) {
-                    return bytesRead; // error after partial read
-                }
-                return -1;
-            }
+static void _romfsDestroyPool(romfs_mount *mount) {
+    romfs_fsa_pool *pool = mount->pool;
+    if (pool == nullptr) {
+        return;
+    }
+    if (pool->owned) {
+        for (auto &slot : pool->idle) {
+            _romfsCloseSlot(&slot);
+        }
+    }
+    delete pool;
+    mount->pool = nullptr;
+}
 
-            if (tmp == alignedBuffer) {
-                memcpy(ptr, alignedBuffer, status);
-            }
+static void _romfsPipelineWorker(romfs_pipeline *pipeline) {
+    std::unique_lock<std::mutex> lock(pipeline->lock);
+    while (true) {
+        pipeline->cond.wait(lock, [pipeline] { return pipeline->pending || !pipeline->running; });
+        if (!pipeline->running) {
+            break;
+        }
+        lock.unlock();
+        FSError result = FSAReadFileWithPos(pipeline->slot.client, pipeline->buffer, 1, pipeline->size, pipeline->pos, pipeline->slot.fd, 0);
+        lock.lock();
+        pipeline->result  = result;
+        pipeline->pending = false;
+        pipeline->done    = true;
+        pipeline->cond.notify_all();
+    }
+}
 
-            pos += (uint32_t) status;
-            bytesRead += (uint32_t) status;
-            ptr = (void *) (((uint32_t) ptr) + status);
+// Claims the mount's pipeline helper together with a second client for it.
+// Returns nullptr if pipelining is disabled or the helper or all other clients are busy.
+static romfs_pipeline *_romfsAcquirePipeline(romfs_mount *mount) {
+    if (!mount->pipelined) {
+        return nullptr;
+    }
+    if (mount->sched != nullptr && __atomic_load_n(&mount->sched->waiting[RomfsPriority_High], __ATOMIC_SEQ_CST) != 0) {
+        // leave the second client to the waiting latency sensitive read
+        return nullptr;
+    }
 
-            if ((size_t) status != size) {
-                return bytesRead; // partial read
-            }
+    romfs_pipeline *pipeline;
+    {
+        std::lock_guard<std::mutex> lock(mount->pool->lock);
+        if (mount->pipeline == nullptr) {
+            mount->pipeline          = new romfs_pipeline();
+            mount->pipeline->running = true;
+            mount->pipeline->thread  = std::thread(_romfsPipelineWorker, mount->pipeline);
+        }
+        pipeline = mount->pipeline;
+        if (pipeline->busy) {
+            return nullptr;
         }
+        pipeline->busy = true;
+    }
 
-        return bytesRead;
+    if (!_romfsAcquireSlot(mount, &pipeline->slot, false)) {
+        std::lock_guard<std::mutex> lock(mount->pool->lock);
+        pipeline->busy = false;
+        return nullptr;
     }
-    return -1;
+    return pipeline;
 }
 
-static bool _romfs_read_chk(romfs_mount *mount, uint64_t offset, void *buffer, uint64_t size) {
-    return _romfs_read(mount, offset, buffer, size) == (int64_t) size;
+static void _romfsReleasePipeline(romfs_mount *mount, romfs_pipeline *pipeline) {
+    _romfsReleaseSlot(mount, &pipeline->slot);
+    std::lock_guard<std::mutex> lock(mount->pool->lock);
+    pipeline->busy = false;
 }
 
-//-----------------------------------------------------------------------------
-
-static int romfs_open(struct _reent *r, void *fileStruct, const char *path, int flags, int mode);
-
-static int romfs_close(struct _reent *r, void *fd);
+static void _romfsDestroyPipeline(romfs_mount *mount) {
+    romfs_pipeline *pipeline = mount->pipeline;
+    if (pipeline == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pipeline->lock);
+        pipeline->running = false;
+        pipeline->cond.notify_all();
+    }
+    pipeline->thread.join();
+    delete pipeline;
+    mount->pipeline = nullptr;
+}
 
-static ssize_t romfs_read(struct _reent *r, void *fd, char *ptr, size_t len);
+static void _romfsPipelineSubmit(romfs_pipeline *pipeline, void *buffer, uint32_t size, uint64_t pos) {
+    std::lock_guard<std::mutex> lock(pipeline->lock);
+    pipeline->buffer  = buffer;
+    pipeline->size    = size;
+    pipeline->pos     = pos;
+    pipeline->done    = false;
+    pipeline->pending = true;
+    pipeline->cond.notify_all();
+}
 
-static off_t romfs_seek(struct _reent *r, void *fd, off_t pos, int dir);
+static FSError _romfsPipelineWait(romfs_pipeline *pipeline) {
+    std::unique_lock<std::mutex> lock(pipeline->lock);
+    pipeline->cond.wait(lock, [pipeline] { return pipeline->done; });
+    pipeline->done = false;
+    return pipeline->result;
+}
 
-static int romfs_fstat(struct _reent *r, void *fd, struct stat *st);
+// Reads a cache-aligned range in readChunkSize pieces, alternating between the
+// calling thread and the pipeline helper so two requests are always in flight.
+static int64_t _romfs_read_pipelined(romfs_mount *mount, const romfs_fsa_slot *slot, romfs_pipeline *pipeline, uint8_t *ptr, uint64_t size, uint64_t pos) {
+    uint64_t chunk     = mount->readChunkSize;
+    uint64_t bytesRead = 0;
 
-static int romfs_stat(struct _reent *r, const char *path, struct stat *st);
+    while (bytesRead < size) {
+        uint32_t first  = MIN(chunk, size - bytesRead);
+        uint32_t second = MIN(chunk, size - bytesRead - first);
 
-static int romfs_chdir(struct _reent *r, const char *path);
+        if (second != 0) {
+            _romfsPipelineSubmit(pipeline, ptr + bytesRead + first, second, pos + bytesRead + first);
+        }
+        FSError status = FSAReadFileWithPos(slot->client, ptr + bytesRead, 1, first, pos + bytesRead, slot->fd, 0);
+        FSError other  = second != 0 ? _romfsPipelineWait(pipeline) : FS_ERROR_OK;
 
-static DIR_ITER *romfs_diropen(struct _reent *r, DIR_ITER *dirState, const char *path);
+        if (status < 0) {
+            return bytesRead != 0 ? (int64_t) bytesRead : -1;
+        }
+        bytesRead += (uint32_t) status;
+        if ((uint32_t) status != first || other < 0) {
+            return bytesRead;
+        }
+        bytesRead += (uint32_t) other;
+        if ((uint32_t) other != second) {
+            return bytesRead;
+        }
+    }
 
-static int romfs_dirreset(struct _reent *r, DIR_ITER *dirState);
+    return bytesRead;
+}
 
-static int romfs_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, struct stat *filestat);
+static ssize_t _romfs_read_cafe(romfs_mount *mount, const romfs_fsa_slot *slot, uint64_t pos, void *buffer, uint64_t readSize) {
+    FSError status;
+    uint32_t bytesRead = 0;
+
+    __attribute__((aligned(0x40))) uint8_t alignedBuffer[0x40];
+    uint64_t len = readSize;
+    void *ptr    = buffer;
+    while (bytesRead < len) {
+        // only use input buffer if cache-aligned and read size is a multiple of cache line size
+        // otherwise read into alignedBuffer
+        uint8_t *tmp = (uint8_t *) ptr;
+        size_t size  = len - bytesRead;
+
+        if (size < 0x40) {
+            // read partial cache-line back-end
+            tmp = alignedBuffer;
+        } else if ((uintptr_t) ptr & 0x3F) {
+            // read partial cache-line front-end
+            tmp  = alignedBuffer;
+            size = MIN(size, 0x40 - ((uintptr_t) ptr & 0x3F));
+        } else {
+            // read whole cache lines
+            size &= ~0x3F;
+
+            // large reads keep two requests in flight
+            romfs_pipeline *pipeline = nullptr;
+            if (size >= 2 * (size_t) mount->readChunkSize && (pipeline = _romfsAcquirePipeline(mount)) != nullptr) {
+                int64_t res = _romfs_read_pipelined(mount, slot, pipeline, tmp, size, pos);
+                _romfsReleasePipeline(mount, pipeline);
+                if (res < 0) {
+                    if (bytesRead != 0) {
+                        return bytesRead; // error after partial read
+                    }
+                    return -1;
+                }
 
-static int romfs_dirclose(struct _reent *r, DIR_ITER *dirState);
+                pos += res;
+                bytesRead += res;
+                ptr = (void *) (((uint32_t) ptr) + res);
 
-typedef struct {
-    romfs_mount *mount;
-    romfs_file *file;
-    uint64_t offset, pos;
-} romfs_fileobj;
+                if ((size_t) res != size) {
+                    return bytesRead; // partial read
+                }
+                continue;
+            }
+        }
 
-typedef struct {
-    romfs_mount *mount;
-    romfs_dir *dir;
-    uint32_t state;
-    uint32_t childDir;
-    uint32_t childFile;
-} romfs_diriter;
+        // Limit each request to the configured chunk size
+        if (size > mount->readChunkSize) {
+            size = mount->readChunkSize;
+        }
 
-static const devoptab_t romFS_devoptab =
-        {
-                .structSize   = sizeof(romfs_fileobj),
-                .open_r       = romfs_open,
-                .close_r      = romfs_close,
-                .read_r       = romfs_read,
-                .seek_r       = romfs_seek,
-                .fstat_r      = romfs_fstat,
-                .stat_r       = romfs_stat,
-                .chdir_r      = romfs_chdir,
-                .dirStateSize = sizeof(romfs_diriter),
-                .diropen_r    = romfs_diropen,
-                .dirreset_r   = romfs_dirreset,
-                .dirnext_r    = romfs_dirnext,
-                .dirclose_r   = romfs_dirclose,
-                // symlinks aren't supported so alias lstat to stat
-                .lstat_r = romfs_stat,
-};
+        status = FSAReadFileWithPos(slot->client, tmp, 1, size, pos, slot->fd, 0);
 
-static bool romfs_initialised = false;
-static romfs_mount romfs_mounts[32];
+        if (status < 0) {
+            if (bytesRead != 0) {
+                return bytesRead; // error after partial read
+            }
+            return -1;
+        }
 
-//-----------------------------------------------------------------------------
+        if (tmp == alignedBuffer) {
+            memcpy(ptr, alignedBuffer, status);
+        }
 
-static int32_t romfsMountCommon(const char *name, romfs_mount *mount);
+        pos += (uint32_t) status;
+        bytesRead += (uint32_t) status;
+        ptr = (void *) (((uint32_t) ptr) + status);
 
-static void romfsInitMtime(romfs_mount *mount);
+        if ((size_t) status != size) {
+            return bytesRead; // partial read
+        }
+    }
 
-static void _romfsResetMount(romfs_mount *mount, int32_t id) {
-    memset(mount, 0, sizeof(*mount));
-    memcpy(&mount->device, &romFS_devoptab, sizeof(romFS_devoptab));
-    mount->device.name       = mount->name;
-    mount->device.deviceData = mount;
-    mount->id                = id;
-    mount->cafe_client       = 0;
-    DCFlushRange(mount, sizeof(*mount));
+    return bytesRead;
 }
 
-static void _romfsInit(void) {
-    uint32_t i;
-    uint32_t total = sizeof(romfs_mounts) / sizeof(romfs_mount);
+static int64_t _romfsFdReadAt(void *userdata, uint64_t pos, void *buffer, uint64_t readSize) {
+    auto *mount = (romfs_mount *) userdata;
+    // seek and read must not interleave with other readers
+    OSLockMutex(&mount->fd_mutex);
+    off_t seek_offset = lseek(mount->fd, pos, SEEK_SET);
+    if (seek_offset < 0 || (off_t) pos != seek_offset) {
+        OSUnlockMutex(&mount->fd_mutex);
+        return -1;
+    }
+    ssize_t res = read(mount->fd, buffer, readSize);
+    OSUnlockMutex(&mount->fd_mutex);
+    return res;
+}
 
-    if (!romfs_initialised) {
-        for (i = 0; i < total; i++) {
-            _romfsResetMount(&romfs_mounts[i], i);
-        }
+static void _romfsFdClose(void *userdata) {
+    auto *mount = (romfs_mount *) userdata;
+    if (!mount->borrowed) {
+        close(mount->fd);
+    }
+}
 
-        romfs_initialised = true;
+static int64_t _romfsCafeReadAt(void *userdata, uint64_t pos, void *buffer, uint64_t readSize) {
+    auto *mount = (romfs_mount *) userdata;
+    romfs_fsa_slot slot;
+    if (!_romfsAcquireSlot(mount, &slot, true)) {
+        return -1;
     }
+    ssize_t res = _romfs_read_cafe(mount, &slot, pos, buffer, readSize);
+    _romfsReleaseSlot(mount, &slot);
+    return res;
 }
 
-static romfs_mount *romfsFindMount(const char *name) {
-    uint32_t i;
-    uint32_t total     = sizeof(romfs_mounts) / sizeof(romfs_mount);
-    romfs_mount *mount = NULL;
+static void _romfsCafeClose(void *userdata) {
+    auto *mount = (romfs_mount *) userdata;
+    _romfsDestroyPipeline(mount);
+    _romfsDestroyPool(mount);
+}
 
-    _romfsInit();
+static void _romfsReleaseMount(romfs_mount *mount);
 
-    for (i = 0; i < total; i++) {
-        mount = &romfs_mounts[i];
+// nested image, offsets are relative to the parent image. The scheduler of the mount that owns the
+// storage admitted the read already, so this goes straight to the parent's backend.
+static int64_t _romfsNestedReadAt(void *userdata, uint64_t pos, void *buffer, uint64_t readSize) {
+    romfs_mount *parent = ((romfs_mount *) userdata)->parent;
+    return parent->backend.readAt(parent->backendData, parent->offset + pos, buffer, readSize);
+}
 
-        if (name == NULL) { //Find an unused mount entry.
-            if (!mount->setup) {
-                return mount;
-            }
-        } else if (mount->setup) { //Find the mount with the input name.
-            if (strncmp(mount->name, name, sizeof(mount->name)) == 0) {
-                return mount;
-            }
-        }
-    }
+static bool _romfsNestedReadAsync(void *userdata, uint64_t pos, void *buffer, uint64_t readSize, romfs_backend_done done, void *doneArg) {
+    romfs_mount *parent = ((romfs_mount *) userdata)->parent;
+    return parent->backend.readAsync(parent->backendData, parent->offset + pos, buffer, readSize, done, doneArg);
+}
 
-    return NULL;
+static const void *_romfsNestedMap(void *userdata, uint64_t pos, uint64_t readSize) {
+    romfs_mount *parent = ((romfs_mount *) userdata)->parent;
+    return parent->backend.map(parent->backendData, parent->offset + pos, readSize);
 }
 
-static romfs_mount *romfs_alloc(void) {
-    return romfsFindMount(NULL);
+static void _romfsNestedClose(void *userdata) {
+    auto *mount = (romfs_mount *) userdata;
+    _romfsReleaseMount(mount->parent);
 }
 
-static void romfs_free(romfs_mount *mount) {
-    if (mount->fileTable) {
-        free(mount->fileTable);
+static int64_t _romfsEmbeddedReadAt(void *userdata, uint64_t pos, void *buffer, uint64_t readSize) {
+    auto *mount = (romfs_mount *) userdata;
+    if (pos >= mount->embedded.size) {
+        return 0;
     }
-    if (mount->fileHashTable) {
-        free(mount->fileHashTable);
+    readSize = MIN(readSize, mount->embedded.size - pos);
+    memcpy(buffer, (const uint8_t *) mount->embedded.data + pos, readSize);
+    return readSize;
+}
+
+static const void *_romfsEmbeddedMap(void *userdata, uint64_t pos, uint64_t size) {
+    auto *mount = (romfs_mount *) userdata;
+    if (pos > mount->embedded.size || size > mount->embedded.size - pos) {
+        return nullptr;
     }
-    if (mount->dirTable) {
-        free(mount->dirTable);
+    return (const uint8_t *) mount->embedded.data + pos;
+}
+
+static const romfs_backend romfs_fd_backend       = {_romfsFdReadAt, nullptr, nullptr, _romfsFdClose};
+static const romfs_backend romfs_cafe_backend     = {_romfsCafeReadAt, nullptr, nullptr, _romfsCafeClose};
+static const romfs_backend romfs_nested_backend   = {_romfsNestedReadAt, _romfsNestedReadAsync, _romfsNestedMap, _romfsNestedClose};
+static const romfs_backend romfs_embedded_backend = {_romfsEmbeddedReadAt, nullptr, _romfsEmbeddedMap, nullptr};
+
+// Highest waiting priority goes first. Low never takes the last slot of a device that allows more than one request.
+static bool _romfsSchedMayStart(romfs_io_sched *sched, RomfsPriority priority) {
+    for (int p = 0; p < priority; p++) {
+        if (sched->waiting[p] != 0) {
+            return false;
+        }
     }
-    if (mount->dirHashTable) {
-        free(mount->dirHashTable);
+    uint32_t limit = sched->limit;
+    if (priority == RomfsPriority_Low && limit > 1) {
+        limit--;
     }
-    _romfsResetMount(mount, mount->id);
+    return sched->active < limit;
 }
 
-static void romfs_mountclose(romfs_mount *mount) {
-    if (mount->fd_type == RomfsSource_FileDescriptor) {
-        close(mount->fd);
-    }
-    if (mount->fd_type == RomfsSource_FileDescriptor_CafeOS) {
-        FSACloseFile(mount->cafe_client, mount->cafe_fd);
-        mount->cafe_fd = 0;
-        FSADelClient(mount->cafe_client);
-        mount->cafe_client = 0;
+static void _romfsSchedAcquire(romfs_io_sched *sched, RomfsPriority priority) {
+    std::unique_lock<std::mutex> lock(sched->lock);
+    sched->waiting[priority]++;
+    sched->cond.wait(lock, [sched, priority] { return _romfsSchedMayStart(sched, priority); });
+    sched->waiting[priority]--;
+    sched->active++;
+}
+
+static void _romfsSchedRelease(romfs_io_sched *sched) {
+    std::lock_guard<std::mutex> lock(sched->lock);
+    sched->active--;
+    sched->cond.notify_all();
+}
+
+static void _romfsSchedSetLimit(romfs_io_sched *sched, uint32_t limit) {
+    std::lock_guard<std::mutex> lock(sched->lock);
+    sched->limit = limit;
+    sched->cond.notify_all();
+}
+
+// Nested mounts read with the chunk size of the mount that owns the storage.
+static uint32_t _romfsReadChunkSize(romfs_mount *mount) {
+    while (mount->parent != nullptr) {
+        mount = mount->parent;
     }
-    romfs_free(mount);
+    return mount->readChunkSize;
 }
 
-std::mutex romfsMutex;
+// Returns size bytes at offset if the storage is memory mapped, otherwise nullptr.
+static const void *_romfsMap(romfs_mount *mount, uint64_t offset, uint64_t size) {
+    if (mount->backend.map == nullptr) {
+        return nullptr;
+    }
+    return mount->backend.map(mount->backendData, mount->offset + offset, size);
+}
 
-int32_t romfsMount(const char *name, const char *filepath, RomfsSource source) {
-    std::lock_guard<std::mutex> lock(romfsMutex);
-    FSAInit();
-    romfs_mount *mount = romfs_alloc();
-    if (mount == nullptr) {
-        OSMemoryBarrier();
-        return -99;
+static ssize_t _romfs_read(romfs_mount *mount, uint64_t readOffset, void *buffer, uint64_t readSize, RomfsPriority priority) {
+    if (readSize == 0) {
+        return 0;
     }
 
-    // Regular RomFS
-    mount->fd_type = source;
+    const void *data = _romfsMap(mount, readOffset, readSize);
+    if (data != nullptr) {
+        memcpy(buffer, data, readSize);
+        return readSize;
+    }
 
-    if (mount->fd_type == RomfsSource_FileDescriptor) {
-        mount->fd = open(filepath, 0);
-        if (mount->fd == -1) {
-            romfs_free(mount);
-            OSMemoryBarrier();
-            return -1;
+    // everything but latency sensitive reads is split, so those can go in between the pieces.
+    // Normal pieces hold two chunks so CafeOS reads stay pipelined, Low pieces hold one so they
+    // never occupy a second client next to the one the scheduler admitted them for.
+    uint64_t pos       = mount->offset + readOffset;
+    uint64_t chunk     = _romfsReadChunkSize(mount);
+    uint64_t slice     = priority == RomfsPriority_High ? readSize : priority == RomfsPriority_Normal ? 2 * chunk : chunk;
+    uint64_t bytesRead = 0;
+    while (bytesRead < readSize) {
+        uint8_t *dst = (uint8_t *) buffer + bytesRead;
+        // end each piece on a cache line of the destination, an unaligned head would leave less than two whole chunks
+        uint64_t len = MIN(slice + ((0x40 - ((uintptr_t) dst & 0x3F)) & 0x3F), readSize - bytesRead);
+        _romfsSchedAcquire(mount->sched, priority);
+        int64_t res = mount->backend.readAt(mount->backendData, pos + bytesRead, dst, len);
+        _romfsSchedRelease(mount->sched);
+        if (res < 0) {
+            return bytesRead != 0 ? (ssize_t) bytesRead : -1;
         }
-    } else if (mount->fd_type == RomfsSource_FileDescriptor_CafeOS) {
-        memset(&mount->cafe_mutex, 0, sizeof(OSMutex));
-        OSInitMutex(&mount->cafe_mutex);
-        mount->cafe_client = FSAAddClient(nullptr);
-        if (mount->cafe_client == 0) {
-            OSReport("libromfs: FSAAddClient failed\n");
-            romfs_free(mount);
-            OSMemoryBarrier();
-            return -1;
-        }
-        FSError result = FSAOpenFileEx(mount->cafe_client, filepath, "r", static_cast<FSMode>(0x666), FS_OPEN_FLAG_NONE, 0, &mount->cafe_fd);
-        if (result != FS_ERROR_OK) {
-            OSReport("libromfs: FSAOpenFileEx failed for %s. %s\n", filepath, FSAGetStatusStr(result));
-            FSADelClient(mount->cafe_client);
-            romfs_free(mount);
-            OSMemoryBarrier();
-            return -1;
+        bytesRead += res;
+        if ((uint64_t) res != len) {
+            break;
         }
     }
-
-    auto res = romfsMountCommon(name, mount);
-    OSMemoryBarrier();
-    return res;
+    return bytesRead;
 }
 
-int32_t romfsMountCommon(const char *name, romfs_mount *mount) {
-    memset(mount->name, 0, sizeof(mount->name));
-    strncpy(mount->name, name, sizeof(mount->name) - 1);
+static bool _romfs_read_chk(romfs_mount *mount, uint64_t offset, void *buffer, uint64_t size, RomfsPriority priority) {
+    return _romfs_read(mount, offset, buffer, size, priority) == (int64_t) size;
+}
 
-    romfsInitMtime(mount);
+//-----------------------------------------------------------------------------
 
-    if (_romfs_read(mount, 0, &mount->header, sizeof(mount->header)) != sizeof(mount->header)) {
-        goto fail_io;
+// Returns the entry containing pos, or nullptr. Must be called with cache->lock held.
+static romfs_cache_entry *_romfsCacheFind(romfs_cache *cache, uint64_t pos) {
+    for (auto *entry : cache->entries) {
+        if (pos >= entry->start && pos < entry->start + entry->size) {
+            return entry;
+        }
     }
+    return nullptr;
+}
 
-    if (memcmp(&mount->header.headerMagic, "WUHB", sizeof(mount->header.headerMagic)) != 0) {
-        goto fail_io;
+// Returns the first cached position after pos, or UINT64_MAX. Must be called with cache->lock held.
+static uint64_t _romfsCacheNextStart(romfs_cache *cache, uint64_t pos) {
+    uint64_t next = UINT64_MAX;
+    for (auto *entry : cache->entries) {
+        if (entry->start > pos && entry->start < next) {
+            next = entry->start;
+        }
     }
+    return next;
+}
 
-    if (mount->header.headerSize != 0x50) {
-        goto fail_io;
+static bool _romfsCacheOverlaps(romfs_cache *cache, uint64_t start, uint64_t size) {
+    for (auto *entry : cache->entries) {
+        if (start < entry->start + entry->size && entry->start < start + size) {
+            return true;
+        }
     }
+    return false;
+}
 
-    mount->dirHashTable  = NULL;
-    mount->dirTable      = NULL;
-    mount->fileHashTable = NULL;
-    mount->fileTable     = NULL;
+// Pinned data is counted against its own budget. Must be called with cache->lock held.
+static uint64_t &_romfsCacheBytes(romfs_cache *cache, romfs_cache_entry *entry) {
+    return entry->pinned ? cache->pinned : cache->used;
+}
 
-    mount->dirHashTable = (uint32_t *) memalign(0x40, mount->header.dirHashTableSize);
-    if (!mount->dirHashTable) {
-        goto fail_oom;
+// Returns true if a queued job overlaps [start, start + size), raising its priority if needed.
+// Must be called with cache->lock held.
+static bool _romfsCacheQueued(romfs_cache *cache, uint64_t start, uint64_t size, RomfsPriority priority) {
+    bool queued = false;
+    for (auto &job : cache->queue) {
+        if (start < job.start + job.size && job.start < start + size) {
+            job.priority = MIN(job.priority, priority);
+            queued       = true;
+        }
     }
-    if (!_romfs_read_chk(mount, mount->header.dirHashTableOff, mount->dirHashTable, mount->header.dirHashTableSize)) {
-        goto fail_io;
+    return queued;
+}
+
+static void _romfsCacheFreeEntry(romfs_cache *cache, romfs_cache_entry *entry) {
+    if (!entry->failed) {
+        _romfsCacheBytes(cache, entry) -= entry->size;
     }
+    free(entry->data);
+    delete entry;
+}
 
-    mount->dirTable = memalign(0x40, mount->header.dirTableSize);
-    if (!mount->dirTable) {
-        goto fail_oom;
+// Drops least recently used entries until size more bytes fit. Must be called with cache->lock held.
+static bool _romfsCacheMakeRoom(romfs_cache *cache, uint64_t size) {
+    while (cache->used + size > cache->limit) {
+        auto victim = cache->entries.end();
+        for (auto it = cache->entries.begin(); it != cache->entries.end(); ++it) {
+            if ((*it)->ready && (*it)->users == 0 && !(*it)->pinned && (victim == cache->entries.end() || (*it)->lastUse < (*victim)->lastUse)) {
+                victim = it;
+            }
+        }
+        if (victim == cache->entries.end()) {
+            return false;
+        }
+        romfs_cache_entry *entry = *victim;
+        cache->entries.erase(victim);
+        _romfsCacheFreeEntry(cache, entry);
     }
-    if (!_romfs_read_chk(mount, mount->header.dirTableOff, mount->dirTable, mount->header.dirTableSize)) {
-        goto fail_io;
+    return true;
+}
+
+// Publishes the result of a cache read. Must be called with cache->lock held.
+static void _romfsCacheFinish(romfs_cache *cache, romfs_cache_entry *entry, bool ok) {
+    entry->users--;
+    if (ok) {
+        entry->ready   = true;
+        entry->lastUse = ++cache->useCounter;
+    } else {
+        // waiting readers fall back to reading themselves, the last one frees the entry
+        cache->entries.erase(std::find(cache->entries.begin(), cache->entries.end(), entry));
+        _romfsCacheBytes(cache, entry) -= entry->size;
+        entry->failed = true;
+        if (entry->users == 0) {
+            _romfsCacheFreeEntry(cache, entry);
+        }
     }
+    cache->cond.notify_all();
+}
 
-    mount->fileHashTable = (uint32_t *) memalign(0x40, mount->header.fileHashTableSize);
-    if (!mount->fileHashTable) {
-        goto fail_oom;
+typedef struct {
+    romfs_cache *cache;
+    romfs_cache_entry *entry;
+    romfs_io_sched *sched;
+} romfs_cache_read;
+
+static void _romfsCacheReadDone(int64_t result, void *doneArg) {
+    auto *read = (romfs_cache_read *) doneArg;
+    _romfsSchedRelease(read->sched);
+    std::lock_guard<std::mutex> lock(read->cache->lock);
+    _romfsCacheFinish(read->cache, read->entry, result == (int64_t) read->entry->size);
+    read->cache->inflight--;
+    delete read;
+}
+
+static void _romfsCacheWorker(romfs_mount *mount) {
+    romfs_cache *cache = mount->cache;
+    std::unique_lock<std::mutex> lock(cache->lock);
+    while (true) {
+        cache->cond.wait(lock, [cache] { return !cache->queue.empty() || !cache->running; });
+        if (!cache->running) {
+            break;
+        }
+        // oldest job of the highest priority first
+        auto next = cache->queue.begin();
+        for (auto it = cache->queue.begin(); it != cache->queue.end(); ++it) {
+            if (it->priority < next->priority) {
+                next = it;
+            }
+        }
+        romfs_cache_job job = *next;
+        cache->queue.erase(next);
+
+        // pinned entries were reserved when they were queued
+        romfs_cache_entry *entry = job.entry;
+        if (entry == nullptr) {
+            if (_romfsCacheOverlaps(cache, job.start, job.size) || !_romfsCacheMakeRoom(cache, job.size)) {
+                continue;
+            }
+            entry        = new romfs_cache_entry();
+            entry->start = job.start;
+            entry->size  = job.size;
+            entry->data  = (uint8_t *) memalign(0x40, (job.size + 0x3F) & ~0x3F);
+            if (entry->data == nullptr) {
+                delete entry;
+                continue;
+            }
+            // readers hitting this range wait for the read instead of issuing their own
+            cache->entries.push_back(entry);
+            cache->used += entry->size;
+            entry->users++;
+        }
+
+        // backends with async reads get as many queued ranges in flight as the scheduler admits
+        if (mount->backend.readAsync != nullptr) {
+            auto *read = new romfs_cache_read{cache, entry, mount->sched};
+            cache->inflight++;
+            lock.unlock();
+            _romfsSchedAcquire(mount->sched, job.priority);
+            bool started = mount->backend.readAsync(mount->backendData, mount->offset + entry->start, entry->data, entry->size, _romfsCacheReadDone, read);
+            if (!started) {
+                _romfsSchedRelease(mount->sched);
+            }
+            lock.lock();
+            if (started) {
+                continue;
+            }
+            cache->inflight--;
+            delete read;
+        }
+
+        lock.unlock();
+        bool ok = _romfs_read_chk(mount, entry->start, entry->data, entry->size, job.priority);
+        lock.lock();
+        _romfsCacheFinish(cache, entry, ok);
     }
-    if (!_romfs_read_chk(mount, mount->header.fileHashTableOff, mount->fileHashTable, mount->header.fileHashTableSize)) {
-        goto fail_io;
+    // entries must not be freed while a backend still writes into them
+    cache->cond.wait(lock, [cache] { return cache->inflight == 0; });
+}
+
+// Must be called with cache->lock held.
+static void _romfsCacheStartWorker(romfs_mount *mount) {
+    if (!mount->cache->running) {
+        mount->cache->running = true;
+        mount->cache->worker  = std::thread(_romfsCacheWorker, mount);
     }
+}
 
-    mount->fileTable = memalign(0x40, mount->header.fileTableSize);
-    if (!mount->fileTable) {
-        goto fail_oom;
+// Queues [start, start + size) of the image for background loading.
+static void _romfsCachePrefetch(romfs_mount *mount, uint64_t start, uint64_t size, RomfsPriority priority) {
+    romfs_cache *cache = mount->cache;
+    if (cache == nullptr || size == 0 || mount->backend.map != nullptr) {
+        // mapped images are served from memory already
+        return;
     }
-    if (!_romfs_read_chk(mount, mount->header.fileTableOff, mount->fileTable, mount->header.fileTableSize)) {
-        goto fail_io;
+    std::lock_guard<std::mutex> lock(cache->lock);
+    _romfsCacheStartWorker(mount);
+    // split into chunk sized entries so eviction doesn't drop too much at once
+    uint64_t chunk = _romfsReadChunkSize(mount);
+    size           = MIN(size, cache->limit);
+    for (uint64_t off = 0; off < size; off += chunk) {
+        uint64_t len = MIN(chunk, size - off);
+        // readahead asks for the same windows on every read until the worker gets to them
+        if (!_romfsCacheOverlaps(cache, start + off, len) && !_romfsCacheQueued(cache, start + off, len, priority)) {
+            cache->queue.push_back({start + off, len, priority, nullptr});
+        }
     }
+    cache->cond.notify_all();
+}
 
-    mount->cwd = romFS_root(mount);
+static void _romfsCacheDrop(romfs_mount *mount, uint64_t start, uint64_t size) {
+    romfs_cache *cache = mount->cache;
+    if (cache == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(cache->lock);
+    for (auto it = cache->queue.begin(); it != cache->queue.end();) {
+        if (it->entry == nullptr && start < it->start + it->size && it->start < start + size) {
+            it = cache->queue.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = cache->entries.begin(); it != cache->entries.end();) {
+        romfs_cache_entry *entry = *it;
+        if (entry->ready && entry->users == 0 && !entry->pinned && start < entry->start + entry->size && entry->start < start + size) {
+            it = cache->entries.erase(it);
+            _romfsCacheFreeEntry(cache, entry);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Returns the pinned entry holding all of [start, start + size), or nullptr. Must be called with cache->lock held.
+static romfs_cache_entry *_romfsCachePinned(romfs_cache *cache, uint64_t start, uint64_t size) {
+    for (auto *entry : cache->entries) {
+        if (entry->pinned && start >= entry->start && start + size <= entry->start + entry->size) {
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+static void _romfsCacheAddPin(romfs_cache_entry *entry, uint64_t start) {
+    auto it = std::lower_bound(entry->pins.begin(), entry->pins.end(), start);
+    if (it == entry->pins.end() || *it != start) {
+        entry->pins.insert(it, start);
+    }
+}
+
+// Loads data ranges of the image into pinned entries that are never evicted. Ranges close to each other
+// are read together, ranges starting at the same offset are stored once.
+// Returns 0, -3 if the pin budget would be exceeded, -4 on read errors or -9 when out of memory.
+static int32_t _romfsCachePin(romfs_mount *mount, std::vector<std::pair<uint64_t, uint64_t>> &blobs, bool background) {
+    romfs_cache *cache = mount->cache;
+    if (cache == nullptr || mount->backend.map != nullptr) {
+        // mapped images are served from memory already
+        return 0;
+    }
+    std::sort(blobs.begin(), blobs.end());
+
+    std::vector<romfs_cache_entry *> loads;
+    {
+        std::lock_guard<std::mutex> lock(cache->lock);
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+        std::vector<std::vector<uint64_t>> rangePins;
+        std::vector<std::pair<romfs_cache_entry *, uint64_t>> held;
+        bool extend = false;
+        for (auto &blob : blobs) {
+            if (blob.second == 0) {
+                continue;
+            }
+            romfs_cache_entry *pinned = _romfsCachePinned(cache, blob.first, blob.second);
+            if (pinned != nullptr) {
+                // loaded by an earlier call, ranges must not grow over it
+                held.emplace_back(pinned, blob.first);
+                extend = false;
+                continue;
+            }
+            uint64_t end = blob.first + blob.second;
+            if (extend && blob.first <= ranges.back().first + ranges.back().second + ROMFS_PIN_MAX_GAP && end - ranges.back().first <= ROMFS_PIN_BLOCK_SIZE) {
+                ranges.back().second = MAX(ranges.back().second, end - ranges.back().first);
+            } else {
+                ranges.push_back(blob);
+                rangePins.emplace_back();
+                extend = true;
+            }
+            if (rangePins.back().empty() || rangePins.back().back() != blob.first) {
+                rangePins.back().push_back(blob.first);
+            }
+        }
+
+        uint64_t total = 0;
+        for (auto &range : ranges) {
+            total += range.second;
+        }
+        if (cache->pinned + total > cache->pinLimit) {
+            return -3;
+        }
+
+        for (auto &range : ranges) {
+            auto *entry  = new romfs_cache_entry();
+            entry->start = range.first;
+            entry->size  = range.second;
+            entry->data  = (uint8_t *) memalign(0x40, (range.second + 0x3F) & ~0x3F);
+            if (entry->data == nullptr) {
+                delete entry;
+                for (auto *load : loads) {
+                    free(load->data);
+                    delete load;
+                }
+                return -9;
+            }
+            entry->pins = std::move(rangePins[loads.size()]);
+            loads.push_back(entry);
+        }
+        for (auto &pin : held) {
+            _romfsCacheAddPin(pin.first, pin.second);
+        }
+
+        // the copies of pinned data in the regular cache are no longer needed
+        for (auto it = cache->entries.begin(); it != cache->entries.end();) {
+            romfs_cache_entry *entry = *it;
+            if (entry->ready && entry->users == 0 && !entry->pinned && std::any_of(ranges.begin(), ranges.end(), [entry](const std::pair<uint64_t, uint64_t> &range) {
+                    return range.first < entry->start + entry->size && entry->start < range.first + range.second;
+                })) {
+                it = cache->entries.erase(it);
+                _romfsCacheFreeEntry(cache, entry);
+            } else {
+                ++it;
+            }
+        }
+
+        // readers hitting a range wait for it to be loaded
+        for (auto *entry : loads) {
+            entry->pinned = true;
+            entry->users  = 1;
+            cache->entries.push_back(entry);
+            cache->pinned += entry->size;
+        }
+
+        if (background) {
+            _romfsCacheStartWorker(mount);
+            for (auto *entry : loads) {
+                cache->queue.push_back({entry->start, entry->size, RomfsPriority_Low, entry});
+            }
+            cache->cond.notify_all();
+            return 0;
+        }
+    }
+
+    int32_t res = 0;
+    for (auto *entry : loads) {
+        bool ok = _romfs_read_chk(mount, entry->start, entry->data, entry->size, RomfsPriority_Normal);
+        std::lock_guard<std::mutex> lock(cache->lock);
+        _romfsCacheFinish(cache, entry, ok);
+        if (!ok) {
+            res = -4;
+        }
+    }
+    return res;
+}
+
+// Releases the pins of the blobs. Entries without pinned blobs left become regular cache entries.
+static void _romfsCacheUnpin(romfs_mount *mount, std::vector<std::pair<uint64_t, uint64_t>> &blobs) {
+    romfs_cache *cache = mount->cache;
+    if (cache == nullptr) {
+        return;
+    }
+    std::sort(blobs.begin(), blobs.end());
+    std::lock_guard<std::mutex> lock(cache->lock);
+    for (auto *entry : cache->entries) {
+        if (!entry->pinned) {
+            continue;
+        }
+        // pinned entries always hold whole blobs
+        auto it = std::lower_bound(blobs.begin(), blobs.end(), std::make_pair(entry->start, (uint64_t) 0));
+        for (; it != blobs.end() && it->first < entry->start + entry->size; ++it) {
+            auto pin = std::lower_bound(entry->pins.begin(), entry->pins.end(), it->first);
+            if (pin != entry->pins.end() && *pin == it->first) {
+                entry->pins.erase(pin);
+            }
+        }
+        if (entry->pins.empty()) {
+            cache->pinned -= entry->size;
+            cache->used += entry->size;
+            entry->pinned  = false;
+            entry->lastUse = ++cache->useCounter;
+        }
+    }
+    _romfsCacheMakeRoom(cache, 0);
+}
+
+static void _romfsDestroyCache(romfs_mount *mount) {
+    romfs_cache *cache = mount->cache;
+    if (cache == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(cache->lock);
+        cache->queue.clear();
+        if (cache->running) {
+            cache->running = false;
+            cache->cond.notify_all();
+        }
+    }
+    if (cache->worker.joinable()) {
+        cache->worker.join();
+    }
+    for (auto *entry : cache->entries) {
+        _romfsCacheFreeEntry(cache, entry);
+    }
+    delete cache;
+    mount->cache = nullptr;
+}
+
+// Like _romfs_read, but serves ranges present in the cache from memory.
+static ssize_t _romfs_read_cached(romfs_mount *mount, uint64_t readOffset, void *buffer, uint64_t readSize, RomfsPriority priority) {
+    romfs_cache *cache = mount->cache;
+    if (cache == nullptr) {
+        return _romfs_read(mount, readOffset, buffer, readSize, priority);
+    }
+
+    uint64_t bytesRead = 0;
+    while (bytesRead < readSize) {
+        uint64_t pos   = readOffset + bytesRead;
+        uint8_t *ptr   = (uint8_t *) buffer + bytesRead;
+        uint64_t size  = readSize - bytesRead;
+        uint64_t uncached;
+        {
+            std::unique_lock<std::mutex> lock(cache->lock);
+            romfs_cache_entry *entry = _romfsCacheFind(cache, pos);
+            if (entry != nullptr) {
+                entry->users++;
+                cache->cond.wait(lock, [entry] { return entry->ready || entry->failed; });
+                if (entry->failed) {
+                    if (--entry->users == 0) {
+                        _romfsCacheFreeEntry(cache, entry);
+                    }
+                    continue;
+                }
+                entry->lastUse = ++cache->useCounter;
+                lock.unlock();
+
+                uint64_t len = MIN(size, entry->start + entry->size - pos);
+                memcpy(ptr, entry->data + (pos - entry->start), len);
+                bytesRead += len;
+
+                lock.lock();
+                entry->users--;
+                continue;
+            }
+            uncached = MIN(size, _romfsCacheNextStart(cache, pos) - pos);
+        }
+
+        ssize_t res = _romfs_read(mount, pos, ptr, uncached, priority);
+        if (res < 0) {
+            return bytesRead != 0 ? (ssize_t) bytesRead : -1;
+        }
+        bytesRead += res;
+        if ((uint64_t) res != uncached) {
+            break;
+        }
+    }
+    return bytesRead;
+}
+
+//-----------------------------------------------------------------------------
+
+static int romfs_open(struct _reent *r, void *fileStruct, const char *path, int flags, int mode);
+
+static int romfs_close(struct _reent *r, void *fd);
+
+static ssize_t romfs_read(struct _reent *r, void *fd, char *ptr, size_t len);
+
+static off_t romfs_seek(struct _reent *r, void *fd, off_t pos, int dir);
+
+static int romfs_fstat(struct _reent *r, void *fd, struct stat *st);
+
+static int romfs_stat(struct _reent *r, const char *path, struct stat *st);
+
+static int romfs_chdir(struct _reent *r, const char *path);
+
+static DIR_ITER *romfs_diropen(struct _reent *r, DIR_ITER *dirState, const char *path);
+
+static int romfs_dirreset(struct _reent *r, DIR_ITER *dirState);
+
+static int romfs_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, struct stat *filestat);
+
+static int romfs_dirclose(struct _reent *r, DIR_ITER *dirState);
+
+typedef struct {
+    romfs_mount *mount;
+    uint32_t fileOff;
+    uint64_t dataSize;
+    uint64_t offset, pos;
+    RomfsAdvice advice;
+    RomfsPriority priority;
+} romfs_fileobj;
+
+typedef struct {
+    romfs_mount *mount;
+    uint32_t dirOff;
+    uint32_t state;
+    uint32_t childDir;
+    uint32_t childFile;
+} romfs_diriter;
+
+static const devoptab_t romFS_devoptab =
+        {
+                .structSize   = sizeof(romfs_fileobj),
+                .open_r       = romfs_open,
+                .close_r      = romfs_close,
+                .read_r       = romfs_read,
+                .seek_r       = romfs_seek,
+                .fstat_r      = romfs_fstat,
+                .stat_r       = romfs_stat,
+                .chdir_r      = romfs_chdir,
+                .dirStateSize = sizeof(romfs_diriter),
+                .diropen_r    = romfs_diropen,
+                .dirreset_r   = romfs_dirreset,
+                .dirnext_r    = romfs_dirnext,
+                .dirclose_r   = romfs_dirclose,
+                // symlinks aren't supported so alias lstat to stat
+                .lstat_r = romfs_stat,
+};
+
+/// Immutable snapshot of all mounts, replaced as a whole on mount and unmount.
+typedef struct romfs_mount_table {
+    uint32_t mask;
+    uint32_t count;
+    romfs_mount *slots[];
+} romfs_mount_table;
+
+// Serializes mount and unmount. Lookups and metadata reads never take it.
+std::mutex romfsMutex;
+
+static romfs_mount_table *romfs_table;
+static uint32_t romfs_epoch;
+static uint32_t romfs_epoch_readers[2];
+static uint32_t romfs_epoch_waiting;
+static std::mutex romfs_epoch_mutex;
+static std::condition_variable romfs_epoch_cond;
+static int32_t romfs_next_id;
+
+// Mount shells are never freed. newlib picks the devoptab entry before a call enters its read section,
+// so a shell has to stay readable after unmount. Unused shells are kept here and reused.
+static std::mutex romfs_shell_mutex;
+static romfs_mount *romfs_free_shells;
+
+//-----------------------------------------------------------------------------
+
+static int32_t romfsMountCommon(const char *name, romfs_mount *mount, uint32_t flags);
+
+static int navigateToDir(romfs_mount *mount, romfs_dir **ppDir, const char **pPath, bool isDir);
+
+static int searchForFile(romfs_mount *mount, romfs_dir *parent, const uint8_t *name, uint32_t namelen, romfs_file **out);
+
+static void romfsInitMtime(romfs_mount *mount);
+
+static void _romfsFreeMetadata(romfs_mount *mount);
+
+static void _romfsBuildBloom(romfs_mount *mount);
+
+static void _romfsPathHashInit(romfs_path_hash *hash);
+
+static int _romfsBeginMetadata(romfs_mount *mount);
+
+static void _romfsEndMetadata(romfs_mount *mount);
+
+// Marks the start of a section that may use mounts or tables without holding a reference.
+// Returns the epoch that has to be passed to _romfsReadUnlock.
+static uint32_t _romfsReadLock(void) {
+    while (true) {
+        uint32_t epoch = __atomic_load_n(&romfs_epoch, __ATOMIC_SEQ_CST) & 1;
+        __atomic_add_fetch(&romfs_epoch_readers[epoch], 1, __ATOMIC_SEQ_CST);
+        if ((__atomic_load_n(&romfs_epoch, __ATOMIC_SEQ_CST) & 1) == epoch) {
+            return epoch;
+        }
+        __atomic_sub_fetch(&romfs_epoch_readers[epoch], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void _romfsReadUnlock(uint32_t epoch) {
+    if (__atomic_sub_fetch(&romfs_epoch_readers[epoch], 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&romfs_epoch_waiting, __ATOMIC_SEQ_CST) != 0) {
+        std::lock_guard<std::mutex> lock(romfs_epoch_mutex);
+        romfs_epoch_cond.notify_all();
+    }
+}
+
+// Waits until every read section that started before this call has ended.
+// New sections don't delay it. Must be called with romfsMutex held.
+static void _romfsSynchronize(void) {
+    uint32_t epoch = __atomic_fetch_add(&romfs_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    // blocks instead of spinning, a spinning thread can starve the readers it waits for on CafeOS
+    std::unique_lock<std::mutex> lock(romfs_epoch_mutex);
+    __atomic_store_n(&romfs_epoch_waiting, 1, __ATOMIC_SEQ_CST);
+    romfs_epoch_cond.wait(lock, [epoch] { return __atomic_load_n(&romfs_epoch_readers[epoch], __ATOMIC_SEQ_CST) == 0; });
+    __atomic_store_n(&romfs_epoch_waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+/// Read section for the lifetime of the object.
+struct romfs_read_section {
+    uint32_t epoch;
+    romfs_read_section() : epoch(_romfsReadLock()) {}
+    ~romfs_read_section() { _romfsReadUnlock(epoch); }
+};
+
+/// Keeps the mount's tables loaded for the lifetime of the object. error is 0 or an errno value.
+struct romfs_metadata_guard {
+    romfs_mount *mount;
+    int error;
+    explicit romfs_metadata_guard(romfs_mount *mount) : mount(mount), error(_romfsBeginMetadata(mount)) {}
+    ~romfs_metadata_guard() {
+        if (error == 0) {
+            _romfsEndMetadata(mount);
+        }
+    }
+};
+
+// Resets everything but the devoptab entry, which never changes once the shell is set up.
+static void _romfsResetMount(romfs_mount *mount, int32_t id) {
+    const size_t keep = offsetof(romfs_mount, device) + sizeof(mount->device);
+    memset((uint8_t *) mount + keep, 0, sizeof(*mount) - keep);
+    mount->id                = id;
+    mount->refs              = 1;
+    mount->readChunkSize     = ROMFS_DEFAULT_READ_CHUNK_SIZE;
+    mount->pipelined         = true;
+    _romfsPathHashInit(&mount->cwdHash);
+    OSInitMutex(&mount->fd_mutex);
+    OSInitMutex(&mount->meta_mutex);
+    DCFlushRange(mount, sizeof(*mount));
+}
+
+static uint32_t _romfsNameHash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < sizeof(((romfs_mount *) 0)->name) - 1 && name[i]; i++) {
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static romfs_mount *_romfsTableFind(romfs_mount_table *table, const char *name) {
+    if (table == nullptr || name == nullptr) {
+        return nullptr;
+    }
+    for (uint32_t i = _romfsNameHash(name);; i++) {
+        romfs_mount *mount = table->slots[i & table->mask];
+        if (mount == nullptr) {
+            return nullptr;
+        }
+        if (strncmp(mount->name, name, sizeof(mount->name)) == 0) {
+            return mount;
+        }
+    }
+}
+
+// Returns the mount a devoptab call was made for, or NULL if it has been unmounted since newlib picked
+// the device. Shells are never freed, so reading the name of a reused one is safe. Must be called inside
+// a read section.
+static romfs_mount *_romfsDeviceMount(struct _reent *r) {
+    auto *mount = (romfs_mount *) r->deviceData;
+    return _romfsTableFind(__atomic_load_n(&romfs_table, __ATOMIC_SEQ_CST), mount->name) == mount ? mount : nullptr;
+}
+
+// Publishes a copy of the mount table with add inserted and/or remove taken out, then frees the old table
+// once no lookup can still be using it. Must be called with romfsMutex held.
+static bool _romfsTablePublish(romfs_mount *add, romfs_mount *remove) {
+    romfs_mount_table *old = romfs_table;
+    uint32_t count         = (old ? old->count : 0) + (add ? 1 : 0) - (remove ? 1 : 0);
+    uint32_t capacity      = 8;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+
+    auto *table = (romfs_mount_table *) calloc(1, sizeof(romfs_mount_table) + capacity * sizeof(romfs_mount *));
+    if (table == nullptr) {
+        return false;
+    }
+    table->mask  = capacity - 1;
+    table->count = count;
+
+    auto insert = [table](romfs_mount *mount) {
+        uint32_t i = _romfsNameHash(mount->name);
+        while (table->slots[i & table->mask] != nullptr) {
+            i++;
+        }
+        table->slots[i & table->mask] = mount;
+    };
+    if (old != nullptr) {
+        for (uint32_t i = 0; i <= old->mask; i++) {
+            if (old->slots[i] != nullptr && old->slots[i] != remove) {
+                insert(old->slots[i]);
+            }
+        }
+    }
+    if (add != nullptr) {
+        insert(add);
+    }
+
+    __atomic_store_n(&romfs_table, table, __ATOMIC_SEQ_CST);
+    _romfsSynchronize();
+    free(old);
+    return true;
+}
+
+static void _romfsRetainMount(romfs_mount *mount) {
+    __atomic_add_fetch(&mount->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+static void romfs_mountclose(romfs_mount *mount);
+
+// Drops a reference, the last one closes the mount.
+static void _romfsReleaseMount(romfs_mount *mount) {
+    if (__atomic_sub_fetch(&mount->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+        romfs_mountclose(mount);
+    }
+}
+
+// Looks up a mount by name without locking. The result has to be passed to _romfsReleaseMount.
+static romfs_mount *_romfsGetMount(const char *name) {
+    romfs_read_section section;
+    romfs_mount *mount = _romfsTableFind(__atomic_load_n(&romfs_table, __ATOMIC_SEQ_CST), name);
+    if (mount != nullptr) {
+        _romfsRetainMount(mount);
+    }
+    return mount;
+}
+
+static romfs_mount *romfs_alloc(void) {
+    romfs_mount *mount;
+    {
+        std::lock_guard<std::mutex> lock(romfs_shell_mutex);
+        mount = romfs_free_shells;
+        if (mount != nullptr) {
+            romfs_free_shells = mount->nextShell;
+        }
+    }
+    if (mount == nullptr) {
+        mount = (romfs_mount *) memalign(0x40, sizeof(romfs_mount));
+        if (mount == nullptr) {
+            return nullptr;
+        }
+        memcpy(&mount->device, &romFS_devoptab, sizeof(romFS_devoptab));
+        mount->device.name       = mount->name;
+        mount->device.deviceData = mount;
+    }
+    _romfsResetMount(mount, __atomic_fetch_add(&romfs_next_id, 1, __ATOMIC_SEQ_CST));
+    return mount;
+}
+
+static void _romfsDestroyTrace(romfs_mount *mount);
+
+static void romfs_free(romfs_mount *mount) {
+    if (mount->path) {
+        free(mount->path);
+    }
+    _romfsDestroyTrace(mount);
+    if (mount->parent == nullptr) {
+        delete mount->sched;
+    }
+    _romfsFreeMetadata(mount);
+
+    std::lock_guard<std::mutex> lock(romfs_shell_mutex);
+    mount->nextShell  = romfs_free_shells;
+    romfs_free_shells = mount;
+}
+
+static void romfs_mountclose(romfs_mount *mount) {
+    _romfsDestroyCache(mount);
+    if (mount->backend.close != nullptr) {
+        mount->backend.close(mount->backendData);
+    }
+    romfs_free(mount);
+}
+
+int32_t romfsMount(const char *name, const char *filepath, RomfsSource source) {
+    return romfsMountEx(name, filepath, source, RomfsMountFlag_None);
+}
+
+int32_t romfsMountEx(const char *name, const char *filepath, RomfsSource source, uint32_t flags) {
+    std::lock_guard<std::mutex> lock(romfsMutex);
+    FSAInit();
+    romfs_mount *mount = romfs_alloc();
+    if (mount == nullptr) {
+        OSMemoryBarrier();
+        return -99;
+    }
+
+    // Regular RomFS
+    mount->fd_type = source;
+
+    if (mount->fd_type == RomfsSource_FileDescriptor) {
+        mount->fd = open(filepath, 0);
+        if (mount->fd == -1) {
+            romfs_free(mount);
+            OSMemoryBarrier();
+            return -1;
+        }
+        mount->backend     = romfs_fd_backend;
+        mount->backendData = mount;
+    } else if (mount->fd_type == RomfsSource_FileDescriptor_CafeOS) {
+        mount->path = strdup(filepath);
+        if (mount->path == nullptr) {
+            romfs_free(mount);
+            OSMemoryBarrier();
+            return -9;
+        }
+        // open the first client right away, the others are opened on demand
+        romfs_fsa_slot slot;
+        if (!_romfsOpenSlot(filepath, &slot)) {
+            romfs_free(mount);
+            OSMemoryBarrier();
+            return -1;
+        }
+        mount->pool         = new romfs_fsa_pool();
+        mount->pool->owned  = true;
+        mount->pool->open   = 1;
+        mount->pool->target = ROMFS_DEFAULT_CLIENT_POOL_SIZE;
+        mount->pool->idle.push_back(slot);
+        mount->backend      = romfs_cafe_backend;
+        mount->backendData  = mount;
+    } else {
+        // backends are registered through romfsMountFromBackend
+        romfs_free(mount);
+        OSMemoryBarrier();
+        return -1;
+    }
+
+    auto res = romfsMountCommon(name, mount, flags);
+    OSMemoryBarrier();
+    return res;
+}
+
+int32_t romfsMountFromFd(const char *name, int fd, uint64_t offset) {
+    std::lock_guard<std::mutex> lock(romfsMutex);
+    if (fd < 0) {
+        return -1;
+    }
+    romfs_mount *mount = romfs_alloc();
+    if (mount == nullptr) {
+        OSMemoryBarrier();
+        return -99;
+    }
+
+    mount->fd_type     = RomfsSource_FileDescriptor;
+    mount->fd          = fd;
+    mount->offset      = offset;
+    mount->borrowed    = true;
+    mount->backend     = romfs_fd_backend;
+    mount->backendData = mount;
+
+    auto res = romfsMountCommon(name, mount, 0);
+    OSMemoryBarrier();
+    return res;
+}
+
+int32_t romfsMountFromFSAHandle(const char *name, FSAClientHandle client, FSAFileHandle handle, uint64_t offset) {
+    std::lock_guard<std::mutex> lock(romfsMutex);
+    romfs_mount *mount = romfs_alloc();
+    if (mount == nullptr) {
+        OSMemoryBarrier();
+        return -99;
+    }
+
+    mount->fd_type  = RomfsSource_FileDescriptor_CafeOS;
+    mount->offset   = offset;
+    mount->borrowed = true;
+
+    // without a path no further clients can be opened, so the pool is just the caller's handle
+    mount->pool         = new romfs_fsa_pool();
+    mount->pool->owned  = false;
+    mount->pool->open   = 1;
+    mount->pool->target = 1;
+    mount->pool->idle.push_back({client, handle});
+    mount->backend     = romfs_cafe_backend;
+    mount->backendData = mount;
+
+    auto res = romfsMountCommon(name, mount, 0);
+    OSMemoryBarrier();
+    return res;
+}
+
+int32_t romfsMountFromRomfs(const char *name, const char *parentName, const char *path, uint64_t offset) {
+    std::lock_guard<std::mutex> lock(romfsMutex);
+    romfs_mount *parent = _romfsGetMount(parentName);
+    if (parent == nullptr) {
+        OSMemoryBarrier();
+        return -2;
+    }
+
+    uint64_t dataOff;
+    {
+        romfs_metadata_guard guard(parent);
+        romfs_dir *curDir = nullptr;
+        romfs_file *file  = nullptr;
+        if (guard.error != 0 || navigateToDir(parent, &curDir, &path, false) != 0) {
+            _romfsReleaseMount(parent);
+            OSMemoryBarrier();
+            return -3;
+        }
+        if (searchForFile(parent, curDir, (uint8_t *) path, strlen(path), &file) != 0) {
+            _romfsReleaseMount(parent);
+            OSMemoryBarrier();
+            return -4;
+        }
+        if (offset >= file->dataSize) {
+            _romfsReleaseMount(parent);
+            OSMemoryBarrier();
+            return -5;
+        }
+        dataOff = file->dataOff;
+    }
+
+    romfs_mount *mount = romfs_alloc();
+    if (mount == nullptr) {
+        _romfsReleaseMount(parent);
+        OSMemoryBarrier();
+        return -99;
+    }
+
+    // all reads go through the parent, sharing its handles. The reference keeps it open
+    // even if the parent itself is unmounted first.
+    mount->fd_type     = parent->fd_type;
+    mount->parent      = parent;
+    mount->offset      = parent->header.fileDataOff + dataOff + offset;
+    mount->borrowed    = true;
+    mount->backend     = romfs_nested_backend;
+    mount->backendData = mount;
+    // prefetching skips mapped storage and uses async reads only where the parent offers them
+    if (parent->backend.readAsync == nullptr) {
+        mount->backend.readAsync = nullptr;
+    }
+    if (parent->backend.map == nullptr) {
+        mount->backend.map = nullptr;
+    }
+
+    auto res = romfsMountCommon(name, mount, 0);
+    OSMemoryBarrier();
+    return res;
+}
+
+int32_t romfsMountFromBackend(const char *name, const romfs_backend *backend, void *userdata, uint64_t offset) {
+    if (backend == nullptr) {
+        return -1;
+    }
+    if (backend->readAt == nullptr) {
+        if (backend->close != nullptr) {
+            backend->close(userdata);
+        }
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(romfsMutex);
+    romfs_mount *mount = romfs_alloc();
+    if (mount == nullptr) {
+        if (backend->close != nullptr) {
+            backend->close(userdata);
+        }
+        OSMemoryBarrier();
+        return -99;
+    }
+
+    mount->fd_type     = RomfsSource_Backend;
+    mount->offset      = offset;
+    mount->borrowed    = true;
+    mount->backend     = *backend;
+    mount->backendData = userdata;
+
+    auto res = romfsMountCommon(name, mount, 0);
+    OSMemoryBarrier();
+    return res;
+}
+
+int32_t romfsMountEmbedded(const char *name, const romfs_embedded *image) {
+    if (image == nullptr || image->data == nullptr || ((uintptr_t) image->data & 3) != 0) {
+        return -1;
+    }
+    if (image->slotCount != 0 && (image->seeds == nullptr || image->bucketCount == 0 || image->slots == nullptr)) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(romfsMutex);
+    romfs_mount *mount = romfs_alloc();
+    if (mount == nullptr) {
+        OSMemoryBarrier();
+        return -99;
+    }
+
+    mount->fd_type     = RomfsSource_Embedded;
+    mount->borrowed    = true;
+    mount->embedded    = *image;
+    mount->backend     = romfs_embedded_backend;
+    mount->backendData = mount;
+    if (image->slotCount == 0) {
+        mount->embedded.seeds       = nullptr;
+        mount->embedded.bucketCount = 0;
+        mount->embedded.slots       = nullptr;
+    }
+
+    auto res = romfsMountCommon(name, mount, 0);
+    OSMemoryBarrier();
+    return res;
+}
+
+static void _romfsFreeMetadata(romfs_mount *mount) {
+    if (!mount->metaMapped) {
+        free(mount->fileTable);
+        free(mount->fileHashTable);
+        free(mount->dirTable);
+        free(mount->dirHashTable);
+    }
+    mount->metaMapped    = false;
+    mount->dirHashTable  = NULL;
+    mount->dirTable      = NULL;
+    mount->fileHashTable = NULL;
+    mount->fileTable     = NULL;
+    delete mount->pathIndex;
+    mount->pathIndex = nullptr;
+    free(mount->bloom);
+    mount->bloom     = nullptr;
+    mount->bloomMask = 0;
+}
+
+// Reads the hash and entry tables described by the header. Returns 0, -9 when out of memory or -10 on I/O errors.
+static int32_t _romfsLoadMetadata(romfs_mount *mount) {
+    // memory mapped images are used in place
+    const void *dirHashTable  = _romfsMap(mount, mount->header.dirHashTableOff, mount->header.dirHashTableSize);
+    const void *dirTable      = _romfsMap(mount, mount->header.dirTableOff, mount->header.dirTableSize);
+    const void *fileHashTable = _romfsMap(mount, mount->header.fileHashTableOff, mount->header.fileHashTableSize);
+    const void *fileTable     = _romfsMap(mount, mount->header.fileTableOff, mount->header.fileTableSize);
+    if (dirHashTable && dirTable && fileHashTable && fileTable &&
+        (((uintptr_t) dirHashTable | (uintptr_t) dirTable | (uintptr_t) fileHashTable | (uintptr_t) fileTable) & 3) == 0) {
+        mount->dirHashTable  = (uint32_t *) dirHashTable;
+        mount->dirTable      = (void *) dirTable;
+        mount->fileHashTable = (uint32_t *) fileHashTable;
+        mount->fileTable     = (void *) fileTable;
+        mount->metaMapped    = true;
+        _romfsBuildBloom(mount);
+        __atomic_store_n(&mount->metaValid, true, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+
+    mount->dirHashTable  = (uint32_t *) memalign(0x40, mount->header.dirHashTableSize);
+    mount->dirTable      = memalign(0x40, mount->header.dirTableSize);
+    mount->fileHashTable = (uint32_t *) memalign(0x40, mount->header.fileHashTableSize);
+    mount->fileTable     = memalign(0x40, mount->header.fileTableSize);
+    if (!mount->dirHashTable || !mount->dirTable || !mount->fileHashTable || !mount->fileTable) {
+        _romfsFreeMetadata(mount);
+        return -9;
+    }
+
+    if (!_romfs_read_chk(mount, mount->header.dirHashTableOff, mount->dirHashTable, mount->header.dirHashTableSize, RomfsPriority_Normal) ||
+        !_romfs_read_chk(mount, mount->header.dirTableOff, mount->dirTable, mount->header.dirTableSize, RomfsPriority_Normal) ||
+        !_romfs_read_chk(mount, mount->header.fileHashTableOff, mount->fileHashTable, mount->header.fileHashTableSize, RomfsPriority_Normal) ||
+        !_romfs_read_chk(mount, mount->header.fileTableOff, mount->fileTable, mount->header.fileTableSize, RomfsPriority_Normal)) {
+        _romfsFreeMetadata(mount);
+        return -10;
+    }
+    _romfsBuildBloom(mount);
+    __atomic_store_n(&mount->metaValid, true, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+// Loads evicted or not yet loaded metadata. Returns 0 or an errno value.
+static int _romfsEnsureMetadata(romfs_mount *mount) {
+    int ret = 0;
+    OSLockMutex(&mount->meta_mutex);
+    if (!__atomic_load_n(&mount->metaValid, __ATOMIC_SEQ_CST)) {
+        switch (_romfsLoadMetadata(mount)) {
+            case 0:
+                break;
+            case -9:
+                ret = ENOMEM;
+                break;
+            default:
+                ret = EIO;
+                break;
+        }
+    }
+    OSUnlockMutex(&mount->meta_mutex);
+    return ret;
+}
+
+static int _romfsBeginMetadata(romfs_mount *mount) {
+    while (true) {
+        // announce the reader before checking, eviction waits for announced readers
+        __atomic_add_fetch(&mount->metaReaders, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&mount->metaValid, __ATOMIC_SEQ_CST)) {
+            return 0;
+        }
+        __atomic_sub_fetch(&mount->metaReaders, 1, __ATOMIC_SEQ_CST);
+        int ret = _romfsEnsureMetadata(mount);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+}
+
+static void _romfsEndMetadata(romfs_mount *mount) {
+    __atomic_sub_fetch(&mount->metaReaders, 1, __ATOMIC_SEQ_CST);
+}
+
+// Frees the metadata unless a reader is using it. Readers arriving in between back off to
+// the mutex and find the tables valid again, so this never waits for them.
+static bool _romfsEvictMetadata(romfs_mount *mount) {
+    bool evicted = true;
+    OSLockMutex(&mount->meta_mutex);
+    if (__atomic_load_n(&mount->metaValid, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&mount->metaValid, false, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&mount->metaReaders, __ATOMIC_SEQ_CST) != 0) {
+            __atomic_store_n(&mount->metaValid, true, __ATOMIC_SEQ_CST);
+            evicted = false;
+        } else {
+            _romfsFreeMetadata(mount);
+        }
+    }
+    OSUnlockMutex(&mount->meta_mutex);
+    return evicted;
+}
+
+static void _romfsBackgroundLoad(romfs_mount *mount) {
+    _romfsEnsureMetadata(mount);
+    _romfsReleaseMount(mount);
+}
+
+int32_t romfsMountCommon(const char *name, romfs_mount *mount, uint32_t flags) {
+    memset(mount->name, 0, sizeof(mount->name));
+    strncpy(mount->name, name, sizeof(mount->name) - 1);
+
+    romfsInitMtime(mount);
+
+    mount->cache           = new romfs_cache();
+    mount->cache->limit    = ROMFS_DEFAULT_CACHE_SIZE;
+    mount->cache->pinLimit = ROMFS_DEFAULT_PIN_BUDGET;
+
+    // as many requests as the storage can serve at once, seek and read on an fd are serialized anyway.
+    // Nested images are scheduled together with the mount that owns the storage.
+    if (mount->parent != nullptr) {
+        mount->sched = mount->parent->sched;
+    } else {
+        mount->sched = new romfs_io_sched();
+        if (mount->pool != nullptr) {
+            mount->sched->limit = mount->pool->target;
+        } else if (mount->fd_type == RomfsSource_Backend) {
+            mount->sched->limit = ROMFS_DEFAULT_BACKEND_DEPTH;
+        } else {
+            mount->sched->limit = 1;
+        }
+    }
+
+    if (_romfsTableFind(romfs_table, mount->name) != nullptr) {
+        romfs_mountclose(mount);
+        return -8;
+    }
+
+    if (_romfs_read(mount, 0, &mount->header, sizeof(mount->header), RomfsPriority_Normal) != sizeof(mount->header)) {
+        goto fail_io;
+    }
+
+    if (memcmp(&mount->header.headerMagic, "WUHB", sizeof(mount->header.headerMagic)) != 0) {
+        goto fail_io;
+    }
+
+    if (mount->header.headerSize != 0x50) {
+        goto fail_io;
+    }
+
+    // lazy mounts load the tables on first use, like after romfsEvictMetadata
+    if (!(flags & (RomfsMountFlag_Lazy | RomfsMountFlag_LoadInBackground))) {
+        switch (_romfsLoadMetadata(mount)) {
+            case 0:
+                break;
+            case -9:
+                goto fail_oom;
+            default:
+                goto fail_io;
+        }
+    }
+
+    mount->cwd = 0;
+
+    if (AddDevice(&mount->device) < 0) {
+        goto fail_oom;
+    }
+    if (!_romfsTablePublish(mount, nullptr)) {
+        RemoveDevice(mount->name);
+        goto fail_oom;
+    }
+
+    if (flags & RomfsMountFlag_LoadInBackground) {
+        _romfsRetainMount(mount);
+        std::thread(_romfsBackgroundLoad, mount).detach();
+    }
+    DCFlushRange(mount, sizeof(*mount));
+    return 0;
+
+fail_oom:
+    romfs_mountclose(mount);
+    return -9;
+
+fail_io:
+    romfs_mountclose(mount);
+    return -10;
+}
+
+static void romfsInitMtime(romfs_mount *mount) {
+    mount->mtime = time(NULL);
+}
+
+int32_t romfsUnmount(const char *name) {
+    std::lock_guard<std::mutex> lock(romfsMutex);
+    romfs_mount *mount;
+    char tmpname[34];
+
+    mount = _romfsTableFind(romfs_table, name);
+    if (mount == NULL) {
+        OSMemoryBarrier();
+        return -1;
+    }
+    if (!_romfsTablePublish(nullptr, mount)) {
+        OSMemoryBarrier();
+        return -9;
+    }
+
+    // Remove device
+    memset(tmpname, 0, sizeof(tmpname));
+    strncpy(tmpname, mount->name, sizeof(tmpname) - 2);
+    strncat(tmpname, ":", sizeof(tmpname) - strlen(tmpname) - 1);
+
+    RemoveDevice(tmpname);
+
+    // wait for devoptab calls that are already using the mount, later ones fail in _romfsDeviceMount.
+    // open files, directories and nested mounts keep their own reference
+    _romfsSynchronize();
+    _romfsReleaseMount(mount);
+
+    OSMemoryBarrier();
+    return 0;
+}
+
+int32_t romfsSetReadChunkSize(const char *name, uint32_t chunkSize) {
+    // requests must stay a multiple of the cache line size, pipelined reads handle two chunks at once
+    if (chunkSize < 0x40 || chunkSize > ROMFS_MAX_READ_CHUNK_SIZE || (chunkSize & 0x3F) != 0) {
+        return -2;
+    }
+    romfs_mount *mount = _romfsGetMount(name);
+    if (mount == NULL) {
+        return -1;
+    }
+    if (mount->parent != nullptr) {
+        // reads are issued by the parent with its settings
+        _romfsReleaseMount(mount);
+        return -3;
+    }
+    mount->readChunkSize = chunkSize;
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return 0;
+}
+
+int32_t romfsSetPipelinedReads(const char *name, bool enabled) {
+    romfs_mount *mount = _romfsGetMount(name);
+    if (mount == NULL) {
+        return -1;
+    }
+    if (mount->parent != nullptr) {
+        // reads are issued by the parent with its settings
+        _romfsReleaseMount(mount);
+        return -3;
+    }
+    // the helper thread itself stays around until unmount, reads may still be using it
+    mount->pipelined = enabled;
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return 0;
+}
+
+int32_t romfsSetClientPoolSize(const char *name, uint32_t count) {
+    if (count == 0 || count > ROMFS_MAX_CLIENT_POOL_SIZE) {
+        return -2;
+    }
+    romfs_mount *mount = _romfsGetMount(name);
+    if (mount == NULL) {
+        return -1;
+    }
+    // nested mounts read through their parent's pool, mounts of an application's FSA handle
+    // have no path to open more clients with
+    if (mount->fd_type != RomfsSource_FileDescriptor_CafeOS || mount->pool == nullptr || !mount->pool->owned) {
+        _romfsReleaseMount(mount);
+        return -3;
+    }
+
+    std::vector<romfs_fsa_slot> closing;
+    {
+        std::lock_guard<std::mutex> poolLock(mount->pool->lock);
+        romfs_fsa_pool *pool = mount->pool;
+        pool->target         = count;
+        // busy clients are closed when they are released
+        while (pool->open > pool->target && !pool->idle.empty()) {
+            closing.push_back(pool->idle.back());
+            pool->idle.pop_back();
+            pool->open--;
+        }
+        pool->cond.notify_all();
+    }
+    _romfsSchedSetLimit(mount->sched, count);
+    for (auto &slot : closing) {
+        _romfsCloseSlot(&slot);
+    }
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+static inline uint8_t normalizePathChar(uint8_t c) {
+    if (c >= 'a' && c <= 'z') {
+        return c + 'A' - 'a';
+    } else {
+        return c;
+    }
+}
+
+static uint32_t calcHash(uint32_t parent, const uint8_t *name, uint32_t namelen, uint32_t total) {
+    uint32_t hash = parent ^ 123456789;
+    uint32_t i;
+    for (i = 0; i < namelen; i++) {
+        hash = (hash >> 5) | (hash << 27);
+        hash ^= normalizePathChar(name[i]);
+    }
+    return hash % total;
+}
+
+static bool comparePaths(const uint8_t *name1, const uint8_t *name2, uint32_t namelen) {
+    for (uint32_t i = 0; i < namelen; i++) {
+        uint8_t c1 = normalizePathChar(name1[i]);
+        uint8_t c2 = normalizePathChar(name2[i]);
+        if (c1 != c2) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int searchForDir(romfs_mount *mount, romfs_dir *parent, const uint8_t *name, uint32_t namelen, romfs_dir **out) {
+    uint64_t parentOff = (uintptr_t) parent - (uintptr_t) mount->dirTable;
+    uint32_t hash      = calcHash(parentOff, name, namelen, mount->header.dirHashTableSize / 4);
+    romfs_dir *curDir  = NULL;
+    uint32_t curOff;
+    *out = NULL;
+    for (curOff = mount->dirHashTable[hash]; curOff != romFS_none; curOff = curDir->nextHash) {
+        curDir = romFS_dir(mount, curOff);
+        if (curDir == NULL) { return EFAULT; }
+        if (curDir->parent != parentOff) {
+            continue;
+        }
+        if (curDir->nameLen != namelen) {
+            continue;
+        }
+        if (!comparePaths(curDir->name, name, namelen)) {
+            continue;
+        }
+        *out = curDir;
+        return 0;
+    }
+    return ENOENT;
+}
+
+static int searchForFile(romfs_mount *mount, romfs_dir *parent, const uint8_t *name, uint32_t namelen, romfs_file **out) {
+    uint64_t parentOff  = (uintptr_t) parent - (uintptr_t) mount->dirTable;
+    uint32_t hash       = calcHash(parentOff, name, namelen, mount->header.fileHashTableSize / 4);
+    romfs_file *curFile = NULL;
+    uint32_t curOff;
+    *out = NULL;
+    for (curOff = mount->fileHashTable[hash]; curOff != romFS_none;
+         curOff = curFile->nextHash) {
+        curFile = romFS_file(mount, curOff);
+        if (curFile == NULL) {
+            return EFAULT;
+        }
+        if (curFile->parent != parentOff) {
+            continue;
+        }
+        if (curFile->nameLen != namelen) {
+            continue;
+        }
+        if (!comparePaths(curFile->name, name, namelen)) {
+            continue;
+        }
+        *out = curFile;
+        return 0;
+    }
+    return ENOENT;
+}
+
+// Walks to the directory that contains the last path component. The caller must hold the metadata.
+static int navigateToDir(romfs_mount *mount, romfs_dir **ppDir, const char **pPath, bool isDir) {
+    const char *colonPos = strchr(*pPath, ':');
+    if (colonPos) { *pPath = colonPos + 1; }
+    if (!**pPath) {
+        return EILSEQ;
+    }
+
+    *ppDir = romFS_dir(mount, mount->cwd);
+    if (**pPath == '/') {
+        *ppDir = romFS_root(mount);
+        (*pPath)++;
+    }
+
+    while (**pPath) {
+        const char *slashPos  = strchr(*pPath, '/');
+        const char *component = *pPath;
+        uint32_t len;
+
+        if (slashPos) {
+            len = slashPos - *pPath;
+            if (!len) {
+                return EILSEQ;
+            }
+            if (len > PATH_MAX) {
+                return ENAMETOOLONG;
+            }
+            *pPath = slashPos + 1;
+        } else if (isDir) {
+            len = strlen(component);
+            *pPath += len;
+        } else {
+            return 0;
+        }
+
+        if (component[0] == '.') {
+            if (len == 1) { continue; }
+            if (len == 2 && component[1] == '.') {
+                *ppDir = romFS_dir(mount, (*ppDir)->parent);
+                if (!*ppDir) {
+                    return EFAULT;
+                }
+                continue;
+            }
+        }
+
+        int ret = searchForDir(mount, *ppDir, (const uint8_t *) component, len, ppDir);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+// Appends the path of a directory, "" for the root. The caller must hold the metadata.
+static bool _romfsDirPath(romfs_mount *mount, uint32_t dirOff, std::string &out, uint32_t depth) {
+    romfs_dir *dir = romFS_dir(mount, dirOff);
+    // parent links of a corrupt image may loop
+    if (dir == nullptr || depth > PATH_MAX / 2) {
+        return false;
+    }
+    if (dirOff == 0) {
+        return true;
+    }
+    if (!_romfsDirPath(mount, dir->parent, out, depth + 1)) {
+        return false;
+    }
+    out.append("/").append((const char *) dir->name, dir->nameLen);
+    return true;
+}
+
+static void _romfsPathHashInit(romfs_path_hash *hash) {
+    hash->h1 = 2166136261u;
+    hash->h2 = 5381;
+}
+
+// Appends "/" and a component, folded like the lookups.
+static void _romfsPathHashAppend(romfs_path_hash *hash, const uint8_t *name, uint32_t len) {
+    uint32_t h1 = (hash->h1 ^ '/') * 16777619u;
+    uint32_t h2 = (hash->h2 * 33) ^ '/';
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t c = normalizePathChar(name[i]);
+        h1        = (h1 ^ c) * 16777619u;
+        h2        = (h2 * 33) ^ c;
+    }
+    hash->h1 = h1;
+    hash->h2 = h2;
+}
+
+static void _romfsBloomAdd(romfs_mount *mount, const romfs_path_hash *hash) {
+    uint32_t step = hash->h2 | 1;
+    for (uint32_t i = 0, bit = hash->h1; i < ROMFS_BLOOM_HASHES; i++, bit += step) {
+        mount->bloom[(bit & mount->bloomMask) / 32] |= 1u << (bit % 32);
+    }
+}
+
+static bool _romfsBloomTest(romfs_mount *mount, const romfs_path_hash *hash) {
+    uint32_t step = hash->h2 | 1;
+    for (uint32_t i = 0, bit = hash->h1; i < ROMFS_BLOOM_HASHES; i++, bit += step) {
+        if (!(mount->bloom[(bit & mount->bloomMask) / 32] & (1u << (bit % 32)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool _romfsBloomAddDir(romfs_mount *mount, romfs_dir *dir, const romfs_path_hash *dirHash, uint32_t depth) {
+    if (depth > PATH_MAX / 2) {
+        // corrupt parent links, don't recurse forever
+        return false;
+    }
+    for (uint32_t off = dir->childFile; off != romFS_none;) {
+        romfs_file *file = romFS_file(mount, off);
+        if (!file) { return false; }
+        romfs_path_hash hash = *dirHash;
+        _romfsPathHashAppend(&hash, file->name, file->nameLen);
+        _romfsBloomAdd(mount, &hash);
+        off = file->sibling;
+    }
+    for (uint32_t off = dir->childDir; off != romFS_none;) {
+        romfs_dir *child = romFS_dir(mount, off);
+        if (!child) { return false; }
+        romfs_path_hash hash = *dirHash;
+        _romfsPathHashAppend(&hash, child->name, child->nameLen);
+        _romfsBloomAdd(mount, &hash);
+        if (!_romfsBloomAddDir(mount, child, &hash, depth + 1)) {
+            return false;
+        }
+        off = child->sibling;
+    }
+    return true;
+}
+
+// Builds a Bloom filter over the folded absolute paths of all entries, so lookups of
+// missing paths fail without walking the tables. Without it every lookup walks them.
+static void _romfsBuildBloom(romfs_mount *mount) {
+    if (mount->embedded.slotCount != 0) {
+        // the embedded index already rejects missing paths
+        return;
+    }
+    uint64_t entries = mount->header.dirTableSize / sizeof(romfs_dir) + mount->header.fileTableSize / sizeof(romfs_file);
+    uint64_t bits    = 512;
+    while (bits < entries * ROMFS_BLOOM_BITS_PER_ENTRY && bits < 0x80000000ull) {
+        bits *= 2;
+    }
+    mount->bloom = (uint32_t *) calloc(bits / 32, sizeof(uint32_t));
+    if (mount->bloom == nullptr) {
+        return;
+    }
+    mount->bloomMask = bits - 1;
+
+    romfs_path_hash root;
+    _romfsPathHashInit(&root);
+    if (romFS_root(mount) == nullptr || !_romfsBloomAddDir(mount, romFS_root(mount), &root, 0)) {
+        free(mount->bloom);
+        mount->bloom     = nullptr;
+        mount->bloomMask = 0;
+    }
+}
+
+// Slot of a path in the perfect hash generated by romfs_embed, which uses the same function.
+static uint32_t _romfsEmbeddedSlot(const romfs_embedded *index, const romfs_path_hash *hash) {
+    uint32_t x = hash->h2 ^ index->seeds[hash->h1 % index->bucketCount];
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x % index->slotCount;
+}
+
+// Checks that the components in [path, end) name the entry with the given name and parent, starting at baseOff.
+static bool _romfsMatchPath(romfs_mount *mount, const char *path, const char *end, const uint8_t *name, uint32_t nameLen, uint32_t parentOff, uint32_t baseOff) {
+    while (true) {
+        const char *component = end;
+        while (component > path && component[-1] != '/') {
+            component--;
+        }
+        if ((uint32_t) (end - component) != nameLen || !comparePaths(name, (const uint8_t *) component, nameLen)) {
+            return false;
+        }
+        if (component == path) {
+            return parentOff == baseOff;
+        }
+        romfs_dir *dir = romFS_dir(mount, parentOff);
+        if (dir == nullptr) {
+            return false;
+        }
+        end       = component - 1;
+        name      = dir->name;
+        nameLen   = dir->nameLen;
+        parentOff = dir->parent;
+    }
+}
+
+// Resolves a path without walking the tables where possible. Returns 1 and sets *outDir or *outFile if it was found
+// through the embedded index, 0 if it doesn't exist, or -1 if the caller has to walk, for example for paths with
+// "." or ".." components or mounts without index and filter. The caller must hold the metadata.
+static int _romfsLookupPath(romfs_mount *mount, const char *path, romfs_dir **outDir, romfs_file **outFile) {
+    *outDir  = nullptr;
+    *outFile = nullptr;
+    if (mount->bloom == nullptr && mount->embedded.slotCount == 0) {
+        return -1;
+    }
+    const char *colonPos = strchr(path, ':');
+    if (colonPos) { path = colonPos + 1; }
+
+    romfs_path_hash hash;
+    uint32_t baseOff;
+    if (*path == '/') {
+        _romfsPathHashInit(&hash);
+        baseOff = 0;
+        path++;
+    } else {
+        hash    = mount->cwdHash;
+        baseOff = mount->cwd;
+    }
+    if (!*path) {
+        return -1;
+    }
+
+    const char *start = path;
+    while (*path) {
+        const char *slashPos = strchr(path, '/');
+        uint32_t len         = slashPos ? slashPos - path : strlen(path);
+        if (len == 0 || (path[0] == '.' && (len == 1 || (len == 2 && path[1] == '.')))) {
+            return -1;
+        }
+        _romfsPathHashAppend(&hash, (const uint8_t *) path, len);
+        path += len;
+        if (*path == '/') {
+            path++;
+        }
+    }
+
+    if (mount->embedded.slotCount == 0) {
+        return _romfsBloomTest(mount, &hash) ? -1 : 0;
+    }
+    // a trailing slash only matches directories, leave that to the walk
+    if (path[-1] == '/') {
+        return -1;
+    }
+
+    // every entry has a slot, so a mismatch means the path doesn't exist
+    uint32_t entry = mount->embedded.slots[_romfsEmbeddedSlot(&mount->embedded, &hash)];
+    if (entry == romFS_none) {
+        return 0;
+    }
+    if (entry & ROMFS_EMBEDDED_DIR) {
+        romfs_dir *dir = romFS_dir(mount, entry & ~ROMFS_EMBEDDED_DIR);
+        if (dir == nullptr || !_romfsMatchPath(mount, start, path, dir->name, dir->nameLen, dir->parent, baseOff)) {
+            return 0;
+        }
+        *outDir = dir;
+    } else {
+        romfs_file *file = romFS_file(mount, entry);
+        if (file == nullptr || !_romfsMatchPath(mount, start, path, file->name, file->nameLen, file->parent, baseOff)) {
+            return 0;
+        }
+        *outFile = file;
+    }
+    return 1;
+}
+
+static ino_t dir_inode(romfs_mount *mount, romfs_dir *dir) {
+    return (uint32_t *) dir - (uint32_t *) mount->dirTable;
+}
+
+static off_t dir_size(romfs_dir *dir) {
+    return sizeof(romfs_dir) + (dir->nameLen + 3) / 4;
+}
+
+static nlink_t dir_nlink(romfs_mount *mount, romfs_dir *dir) {
+    nlink_t count   = 2; // one for self, one for parent
+    uint32_t offset = dir->childDir;
+
+    while (offset != romFS_none) {
+        romfs_dir *tmp = romFS_dir(mount, offset);
+        if (!tmp) { break; }
+        ++count;
+        offset = tmp->sibling;
+    }
+
+    offset = dir->childFile;
+    while (offset != romFS_none) {
+        romfs_file *tmp = romFS_file(mount, offset);
+        if (!tmp) { break; }
+        ++count;
+        offset = tmp->sibling;
+    }
+
+    return count;
+}
+
+static ino_t file_inode(romfs_mount *mount, uint32_t fileOff) {
+    return fileOff / 4 + mount->header.dirTableSize / 4;
+}
+
+static int _romfsGetFileInfo(romfs_mount *mount, const char *path, romfs_fileInfo *out) {
+    romfs_metadata_guard guard(mount);
+    if (guard.error != 0) {
+        return -3;
+    }
+    romfs_dir *curDir = nullptr;
+    romfs_file *file  = nullptr;
+    int found         = _romfsLookupPath(mount, path, &curDir, &file);
+    if (found == 0) {
+        return -4;
+    }
+    if (file == nullptr) {
+        if (navigateToDir(mount, &curDir, &path, false) != 0) {
+            return -3;
+        }
+        int err = searchForFile(mount, curDir, (uint8_t *) path, strlen(path), &file);
+        if (err != 0) {
+            return -4;
+        }
+    }
+
+    out->length = file->dataSize;
+    out->offset = mount->header.fileDataOff + file->dataOff;
+    return 0;
+}
+
+int romfsGetFileInfoPerPath(const char *romfs, const char *path, romfs_fileInfo *out) {
+    if (out == nullptr) {
+        return -1;
+    }
+    romfs_mount *mount = _romfsGetMount(romfs);
+    if (mount == nullptr) {
+        OSMemoryBarrier();
+        return -2;
+    }
+    int res = _romfsGetFileInfo(mount, path, out);
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+
+typedef struct {
+    uint64_t dataOff;
+    uint64_t dataSize;
+    std::string path;
+} romfs_extract_file;
+
+typedef struct {
+    uint32_t file;
+    uint64_t fileOffset;
+    uint32_t bufferOffset;
+    uint32_t length;
+} romfs_extract_piece;
+
+typedef struct {
+    uint8_t *data;
+    std::vector<romfs_extract_piece> pieces;
+} romfs_extract_block;
+
+typedef struct {
+    std::mutex lock;
+    std::condition_variable cond;
+    romfs_extract_block blocks[2];
+    bool filled[2];
+    bool finished;
+    bool failed;
+    uint64_t written;
+} romfs_extract_state;
+
+// Collects every file below dir (in any order) together with its destination path.
+static bool _romfsCollectFiles(romfs_mount *mount, romfs_dir *dir, const std::string &dest, std::vector<std::string> &dirs, std::vector<romfs_extract_file> &files, uint32_t depth) {
+    // corrupt images may nest (or loop) deeper than any valid path
+    if (depth > PATH_MAX / 2) {
+        return false;
+    }
+    dirs.push_back(dest);
+
+    uint32_t offset = dir->childFile;
+    while (offset != romFS_none) {
+        romfs_file *file = romFS_file(mount, offset);
+        if (!file) { return false; }
+        files.push_back({file->dataOff, file->dataSize, dest + "/" + std::string((const char *) file->name, file->nameLen)});
+        offset = file->sibling;
+    }
+
+    offset = dir->childDir;
+    while (offset != romFS_none) {
+        romfs_dir *child = romFS_dir(mount, offset);
+        if (!child) { return false; }
+        if (!_romfsCollectFiles(mount, child, dest + "/" + std::string((const char *) child->name, child->nameLen), dirs, files, depth + 1)) {
+            return false;
+        }
+        offset = child->sibling;
+    }
+    return true;
+}
+
+static void _romfsExtractWriter(romfs_extract_state *state, const std::vector<romfs_extract_file> *files, int destFd) {
+    int32_t curFile = -1;
+    int fd          = destFd;
+    uint32_t index  = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(state->lock);
+            state->cond.wait(lock, [state, index] { return state->filled[index] || state->finished || state->failed; });
+            if (!state->filled[index] || state->failed) {
+                break;
+            }
+        }
+
+        romfs_extract_block *block = &state->blocks[index];
+        bool ok                    = true;
+        for (auto &piece : block->pieces) {
+            if ((int32_t) piece.file != curFile) {
+                if (destFd < 0) {
+                    if (fd >= 0) {
+                        close(fd);
+                    }
+                    fd = open((*files)[piece.file].path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                    if (fd < 0) {
+                        ok = false;
+                        break;
+                    }
+                }
+                curFile = piece.file;
+            }
+            uint32_t done = 0;
+            while (done < piece.length) {
+                ssize_t res = write(fd, block->data + piece.bufferOffset + done, piece.length - done);
+                if (res <= 0) {
+                    ok = false;
+                    break;
+                }
+                done += res;
+            }
+            if (!ok) {
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(state->lock);
+        if (!ok) {
+            state->failed = true;
+        } else {
+            for (auto &piece : block->pieces) {
+                state->written += piece.length;
+            }
+        }
+        state->filled[index] = false;
+        state->cond.notify_all();
+        index ^= 1;
+    }
+
+    if (destFd < 0 && fd >= 0) {
+        close(fd);
+    }
+}
 
-    if (AddDevice(&mount->device) < 0) {
-        goto fail_oom;
+// Reads the files in dataOff order into two large buffers while a second thread
+// writes the previous buffer out. Adjacent files are merged into a single read.
+static int32_t _romfsExtractFiles(romfs_mount *mount, std::vector<romfs_extract_file> &files, int destFd, romfs_progress_callback callback, void *userdata) {
+    std::sort(files.begin(), files.end(), [](const romfs_extract_file &a, const romfs_extract_file &b) { return a.dataOff < b.dataOff; });
+
+    uint64_t total = 0;
+    for (auto &file : files) {
+        total += file.dataSize;
     }
 
-    mount->setup = true;
-    DCFlushRange(mount, sizeof(*mount));
-    return 0;
+    romfs_extract_state state{};
+    for (auto &block : state.blocks) {
+        block.data = (uint8_t *) memalign(0x40, ROMFS_EXTRACT_BLOCK_SIZE);
+        if (!block.data) {
+            free(state.blocks[0].data);
+            return -9;
+        }
+    }
 
-fail_oom:
-    romfs_mountclose(mount);
-    return -9;
+    std::thread writer(_romfsExtractWriter, &state, &files, destFd);
 
-fail_io:
-    romfs_mountclose(mount);
-    return -10;
+    int32_t result      = 0;
+    uint32_t index      = 0;
+    uint32_t curFile    = 0;
+    uint64_t fileOffset = 0;
+    while (curFile < files.size()) {
+        uint64_t written;
+        {
+            std::unique_lock<std::mutex> lock(state.lock);
+            state.cond.wait(lock, [&state, index] { return !state.filled[index] || state.failed; });
+            if (state.failed) {
+                break;
+            }
+            written = state.written;
+        }
+        if (callback && !callback(written, total, userdata)) {
+            result = -5;
+            break;
+        }
+
+        romfs_extract_block *block = &state.blocks[index];
+        block->pieces.clear();
+        uint64_t start = mount->header.fileDataOff + files[curFile].dataOff + fileOffset;
+        uint64_t end   = start;
+        while (curFile < files.size()) {
+            auto &file      = files[curFile];
+            uint64_t offset = mount->header.fileDataOff + file.dataOff + fileOffset;
+            // deduplicated files may start before the end of the data already read
+            if (offset > end + ROMFS_EXTRACT_MAX_GAP || offset - start >= ROMFS_EXTRACT_BLOCK_SIZE) {
+                break;
+            }
+            uint32_t length = MIN(file.dataSize - fileOffset, ROMFS_EXTRACT_BLOCK_SIZE - (offset - start));
+            block->pieces.push_back({curFile, fileOffset, (uint32_t) (offset - start), length});
+            end = MAX(end, offset + length);
+            fileOffset += length;
+            if (fileOffset != file.dataSize) {
+                break; // block is full
+            }
+            curFile++;
+            fileOffset = 0;
+        }
+
+        // read whole cache lines so the request goes straight into the block
+        uint64_t readSize = MIN((end - start + 0x3F) & ~0x3F, ROMFS_EXTRACT_BLOCK_SIZE);
+        ssize_t res       = _romfs_read(mount, start, block->data, readSize, RomfsPriority_Low);
+        if (res < 0 || (uint64_t) res < end - start) {
+            result = -3;
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock(state.lock);
+        state.filled[index] = true;
+        state.cond.notify_all();
+        index ^= 1;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(state.lock);
+        state.finished = true;
+        if (result != 0) {
+            state.failed = true;
+        }
+        state.cond.notify_all();
+    }
+    writer.join();
+
+    if (result == 0 && state.failed) {
+        result = -4;
+    }
+    if (result == 0 && callback) {
+        callback(state.written, total, userdata);
+    }
+
+    free(state.blocks[0].data);
+    free(state.blocks[1].data);
+    return result;
 }
 
-static void romfsInitMtime(romfs_mount *mount) {
-    mount->mtime = time(NULL);
+// Looks up the mount of a "name:/path". The result has to be passed to _romfsReleaseMount.
+static romfs_mount *_romfsGetPathMount(const char *romfsPath) {
+    const char *colonPos = strchr(romfsPath, ':');
+    if (colonPos == nullptr || (size_t) (colonPos - romfsPath) >= sizeof(((romfs_mount *) 0)->name)) {
+        return nullptr;
+    }
+    char name[32] = {};
+    memcpy(name, romfsPath, colonPos - romfsPath);
+    return _romfsGetMount(name);
 }
 
-int32_t romfsUnmount(const char *name) {
-    std::lock_guard<std::mutex> lock(romfsMutex);
-    romfs_mount *mount;
-    char tmpname[34];
+// Resolves "name:/path" to its entry. Exactly one of outDir/outFile is set on success.
+// The caller must hold the mount's metadata.
+static int32_t _romfsResolvePath(romfs_mount *mount, const char *romfsPath, romfs_dir **outDir, romfs_file **outFile) {
+    const char *path  = romfsPath;
+    romfs_dir *curDir = nullptr;
+    if (navigateToDir(mount, &curDir, &path, false) != 0) {
+        return -2;
+    }
 
-    mount = romfsFindMount(name);
-    if (mount == NULL) {
+    *outDir   = nullptr;
+    *outFile  = nullptr;
+    if (!*path) {
+        *outDir = curDir;
+        return 0;
+    }
+    if (searchForDir(mount, curDir, (uint8_t *) path, strlen(path), outDir) == 0) {
+        return 0;
+    }
+    if (searchForFile(mount, curDir, (uint8_t *) path, strlen(path), outFile) == 0) {
+        return 0;
+    }
+    return -2;
+}
+
+// Creates the missing directories leading up to path, but not path itself.
+static bool _romfsMakeParentDirs(const std::string &path) {
+    for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        // "sd:/" and "//" don't name a directory
+        if (path[pos - 1] == ':' || path[pos - 1] == '/') {
+            continue;
+        }
+        // existing ancestors like "fs:/vol" can't be created again and may not report EEXIST
+        std::string parent = path.substr(0, pos);
+        struct stat st;
+        if (stat(parent.c_str(), &st) == 0) {
+            continue;
+        }
+        if (errno != ENOENT || (mkdir(parent.c_str(), 0777) != 0 && errno != EEXIST)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int32_t romfsExtract(const char *romfsPath, const char *destPath, romfs_progress_callback callback, void *userdata) {
+    if (romfsPath == nullptr || destPath == nullptr) {
+        return -1;
+    }
+
+    romfs_mount *mount = _romfsGetPathMount(romfsPath);
+    if (mount == nullptr) {
         OSMemoryBarrier();
         return -1;
     }
+    std::vector<std::string> dirs;
+    std::vector<romfs_extract_file> files;
+    {
+        romfs_metadata_guard guard(mount);
+        romfs_dir *dir;
+        romfs_file *file;
+        int32_t res = guard.error != 0 ? -3 : _romfsResolvePath(mount, romfsPath, &dir, &file);
+        if (res == 0 && file != nullptr) {
+            files.push_back({file->dataOff, file->dataSize, destPath});
+        } else if (res == 0 && !_romfsCollectFiles(mount, dir, destPath, dirs, files, 0)) {
+            res = -3;
+        }
+        if (res != 0) {
+            _romfsReleaseMount(mount);
+            OSMemoryBarrier();
+            return res;
+        }
+    }
 
-    // Remove device
-    memset(tmpname, 0, sizeof(tmpname));
-    strncpy(tmpname, mount->name, sizeof(tmpname) - 2);
-    strncat(tmpname, ":", sizeof(tmpname) - strlen(tmpname) - 1);
+    int32_t result = 0;
+    if (!_romfsMakeParentDirs(destPath)) {
+        result = -4;
+    }
+    for (auto &dir : dirs) {
+        if (result != 0) {
+            break;
+        }
+        if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+            result = -4;
+        }
+    }
+    if (result == 0) {
+        result = _romfsExtractFiles(mount, files, -1, callback, userdata);
+    }
 
-    RemoveDevice(tmpname);
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return result;
+}
 
-    romfs_mountclose(mount);
+int32_t romfsExtractToFd(const char *romfsPath, int fd, romfs_progress_callback callback, void *userdata) {
+    if (romfsPath == nullptr || fd < 0) {
+        return -1;
+    }
+
+    romfs_mount *mount = _romfsGetPathMount(romfsPath);
+    if (mount == nullptr) {
+        OSMemoryBarrier();
+        return -1;
+    }
+    std::vector<romfs_extract_file> files;
+    {
+        romfs_metadata_guard guard(mount);
+        romfs_dir *dir;
+        romfs_file *file;
+        int32_t res = guard.error != 0 ? -3 : _romfsResolvePath(mount, romfsPath, &dir, &file);
+        if (res != 0 || file == nullptr) {
+            _romfsReleaseMount(mount);
+            OSMemoryBarrier();
+            return res != 0 ? res : -2;
+        }
+        files.push_back({file->dataOff, file->dataSize, ""});
+    }
 
+    int32_t result = _romfsExtractFiles(mount, files, fd, callback, userdata);
+
+    _romfsReleaseMount(mount);
     OSMemoryBarrier();
-    return 0;
+    return result;
 }
 
-//-----------------------------------------------------------------------------
+static romfs_fileobj *_romfsGetFileObj(int fd) {
+    __handle *handle = __get_handle(fd);
+    if (handle == nullptr || handle->fileStruct == nullptr) {
+        return nullptr;
+    }
+    const devoptab_t *device = devoptab_list[handle->device];
+    if (device == nullptr || device->open_r != romfs_open) {
+        return nullptr;
+    }
+    return (romfs_fileobj *) handle->fileStruct;
+}
 
-static inline uint8_t normalizePathChar(uint8_t c) {
-    if (c >= 'a' && c <= 'z') {
-        return c + 'A' - 'a';
-    } else {
-        return c;
+static int32_t _romfsAdviseRange(romfs_mount *mount, uint64_t dataStart, uint64_t dataSize, uint64_t offset, uint64_t length, RomfsAdvice advice, RomfsPriority priority) {
+    if (offset >= dataSize) {
+        return 0;
     }
+    if (length == 0 || length > dataSize - offset) {
+        length = dataSize - offset;
+    }
+    if (advice == RomfsAdvice_WillNeed) {
+        _romfsCachePrefetch(mount, dataStart + offset, length, priority);
+    } else if (advice == RomfsAdvice_DontNeed) {
+        _romfsCacheDrop(mount, dataStart + offset, length);
+    }
+    return 0;
 }
 
-static uint32_t calcHash(uint32_t parent, const uint8_t *name, uint32_t namelen, uint32_t total) {
-    uint32_t hash = parent ^ 123456789;
-    uint32_t i;
-    for (i = 0; i < namelen; i++) {
-        hash = (hash >> 5) | (hash << 27);
-        hash ^= normalizePathChar(name[i]);
+int32_t romfsAdvise(int fd, uint64_t offset, uint64_t length, RomfsAdvice advice) {
+    romfs_fileobj *file = _romfsGetFileObj(fd);
+    if (file == nullptr) {
+        return -1;
     }
-    return hash % total;
+    switch (advice) {
+        case RomfsAdvice_Normal:
+        case RomfsAdvice_Sequential:
+        case RomfsAdvice_Random:
+            file->advice = advice;
+            OSMemoryBarrier();
+            return 0;
+        case RomfsAdvice_WillNeed:
+        case RomfsAdvice_DontNeed:
+            return _romfsAdviseRange(file->mount, file->offset, file->dataSize, offset, length, advice, file->priority);
+    }
+    return -3;
 }
 
-static bool comparePaths(const uint8_t *name1, const uint8_t *name2, uint32_t namelen) {
-    for (uint32_t i = 0; i < namelen; i++) {
-        uint8_t c1 = normalizePathChar(name1[i]);
-        uint8_t c2 = normalizePathChar(name2[i]);
-        if (c1 != c2) {
+int32_t romfsAdvisePath(const char *romfsPath, uint64_t offset, uint64_t length, RomfsAdvice advice) {
+    if (romfsPath == nullptr) {
+        return -1;
+    }
+    if (advice != RomfsAdvice_WillNeed && advice != RomfsAdvice_DontNeed) {
+        // access patterns only apply to open files
+        return -3;
+    }
+    romfs_mount *mount = _romfsGetPathMount(romfsPath);
+    if (mount == nullptr) {
+        OSMemoryBarrier();
+        return -1;
+    }
+    uint64_t dataStart, dataSize;
+    {
+        romfs_metadata_guard guard(mount);
+        romfs_dir *dir;
+        romfs_file *file;
+        int32_t res = guard.error != 0 ? -2 : _romfsResolvePath(mount, romfsPath, &dir, &file);
+        if (res != 0 || file == nullptr) {
+            _romfsReleaseMount(mount);
+            OSMemoryBarrier();
+            return -2;
+        }
+        dataStart = mount->header.fileDataOff + file->dataOff;
+        dataSize  = file->dataSize;
+    }
+    int32_t res = _romfsAdviseRange(mount, dataStart, dataSize, offset, length, advice, RomfsPriority_Low);
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return res;
+}
+
+// Collects the data ranges of every file below dir.
+static bool _romfsCollectData(romfs_mount *mount, romfs_dir *dir, std::vector<std::pair<uint64_t, uint64_t>> &blobs, uint32_t depth) {
+    if (depth > PATH_MAX / 2) {
+        return false;
+    }
+    for (uint32_t offset = dir->childFile; offset != romFS_none;) {
+        romfs_file *file = romFS_file(mount, offset);
+        if (!file) { return false; }
+        blobs.emplace_back(mount->header.fileDataOff + file->dataOff, file->dataSize);
+        offset = file->sibling;
+    }
+    for (uint32_t offset = dir->childDir; offset != romFS_none;) {
+        romfs_dir *child = romFS_dir(mount, offset);
+        if (!child) { return false; }
+        if (!_romfsCollectData(mount, child, blobs, depth + 1)) {
             return false;
         }
+        offset = child->sibling;
     }
     return true;
 }
 
-static int searchForDir(romfs_mount *mount, romfs_dir *parent, const uint8_t *name, uint32_t namelen, romfs_dir **out) {
-    uint64_t parentOff = (uintptr_t) parent - (uintptr_t) mount->dirTable;
-    uint32_t hash      = calcHash(parentOff, name, namelen, mount->header.dirHashTableSize / 4);
-    romfs_dir *curDir  = NULL;
-    uint32_t curOff;
-    *out = NULL;
-    for (curOff = mount->dirHashTable[hash]; curOff != romFS_none; curOff = curDir->nextHash) {
-        curDir = romFS_dir(mount, curOff);
-        if (curDir == NULL) { return EFAULT; }
-        if (curDir->parent != parentOff) {
-            continue;
+// Looks up the mount of romfsPath and the data ranges of the file or all files below the directory.
+// Returns 0 with a mount reference the caller has to release, -1 if the mount or -2 if the path was not found.
+static int32_t _romfsGetPathData(const char *romfsPath, romfs_mount **outMount, std::vector<std::pair<uint64_t, uint64_t>> &blobs) {
+    romfs_mount *mount = _romfsGetPathMount(romfsPath);
+    if (mount == nullptr) {
+        return -1;
+    }
+    int32_t res;
+    {
+        romfs_metadata_guard guard(mount);
+        romfs_dir *dir;
+        romfs_file *file;
+        res = guard.error != 0 ? -2 : _romfsResolvePath(mount, romfsPath, &dir, &file);
+        if (res == 0 && file != nullptr) {
+            blobs.emplace_back(mount->header.fileDataOff + file->dataOff, file->dataSize);
+        } else if (res == 0 && !_romfsCollectData(mount, dir, blobs, 0)) {
+            res = -2;
         }
-        if (curDir->nameLen != namelen) {
-            continue;
+    }
+    if (res != 0) {
+        _romfsReleaseMount(mount);
+        return -2;
+    }
+    *outMount = mount;
+    return 0;
+}
+
+int32_t romfsPin(const char *romfsPath, bool background) {
+    if (romfsPath == nullptr) {
+        return -1;
+    }
+    romfs_mount *mount;
+    std::vector<std::pair<uint64_t, uint64_t>> blobs;
+    int32_t res = _romfsGetPathData(romfsPath, &mount, blobs);
+    if (res != 0) {
+        OSMemoryBarrier();
+        return res;
+    }
+    res = _romfsCachePin(mount, blobs, background);
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return res;
+}
+
+int32_t romfsUnpin(const char *romfsPath) {
+    if (romfsPath == nullptr) {
+        return -1;
+    }
+    romfs_mount *mount;
+    std::vector<std::pair<uint64_t, uint64_t>> blobs;
+    int32_t res = _romfsGetPathData(romfsPath, &mount, blobs);
+    if (res != 0) {
+        OSMemoryBarrier();
+        return res;
+    }
+    _romfsCacheUnpin(mount, blobs);
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return 0;
+}
+
+int32_t romfsSetPriority(int fd, RomfsPriority priority) {
+    romfs_fileobj *file = _romfsGetFileObj(fd);
+    if (file == nullptr) {
+        return -1;
+    }
+    if (priority < RomfsPriority_High || priority > RomfsPriority_Low) {
+        return -3;
+    }
+    file->priority = priority;
+    OSMemoryBarrier();
+    return 0;
+}
+
+static bool _romfsEvictMount(romfs_mount *mount) {
+    if (!_romfsEvictMetadata(mount)) {
+        return false;
+    }
+    _romfsCacheDrop(mount, 0, UINT64_MAX);
+    return true;
+}
+
+int32_t romfsEvictMetadata(const char *name) {
+    if (name == nullptr) {
+        std::vector<romfs_mount *> mounts;
+        {
+            romfs_read_section section;
+            romfs_mount_table *table = __atomic_load_n(&romfs_table, __ATOMIC_SEQ_CST);
+            for (uint32_t i = 0; table != nullptr && i <= table->mask; i++) {
+                if (table->slots[i] != nullptr) {
+                    _romfsRetainMount(table->slots[i]);
+                    mounts.push_back(table->slots[i]);
+                }
+            }
         }
-        if (!comparePaths(curDir->name, name, namelen)) {
-            continue;
+        for (auto *mount : mounts) {
+            _romfsEvictMount(mount);
+            _romfsReleaseMount(mount);
         }
-        *out = curDir;
+        OSMemoryBarrier();
         return 0;
     }
-    return ENOENT;
+    romfs_mount *mount = _romfsGetMount(name);
+    if (mount == nullptr) {
+        return -1;
+    }
+    // a lookup, query or an extraction may still be walking the tables
+    int32_t res = _romfsEvictMount(mount) ? 0 : -2;
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return res;
+}
+
+int32_t romfsGetMemoryUsage(const char *name, romfs_memoryUsage *out) {
+    if (out == nullptr) {
+        return -1;
+    }
+    romfs_mount *mount = _romfsGetMount(name);
+    if (mount == nullptr) {
+        return -1;
+    }
+    memset(out, 0, sizeof(*out));
+    OSLockMutex(&mount->meta_mutex);
+    if (mount->metaValid) {
+        if (!mount->metaMapped) {
+            out->metadata = mount->header.dirHashTableSize + mount->header.dirTableSize + mount->header.fileHashTableSize + mount->header.fileTableSize;
+        }
+        if (mount->bloom != nullptr) {
+            out->metadata += (mount->bloomMask + 1) / 8;
+        }
+    }
+    if (mount->pathIndex != nullptr) {
+        out->index = mount->pathIndex->paths.capacity() + mount->pathIndex->entries.capacity() * sizeof(romfs_path_entry);
+    }
+    OSUnlockMutex(&mount->meta_mutex);
+    {
+        std::lock_guard<std::mutex> cacheLock(mount->cache->lock);
+        out->cache  = mount->cache->used;
+        out->pinned = mount->cache->pinned;
+    }
+    out->total = out->metadata + out->index + out->cache + out->pinned;
+    _romfsReleaseMount(mount);
+    return 0;
+}
+
+int32_t romfsSetCacheSize(const char *name, uint32_t size) {
+    romfs_mount *mount = _romfsGetMount(name);
+    if (mount == NULL) {
+        return -1;
+    }
+    {
+        std::lock_guard<std::mutex> cacheLock(mount->cache->lock);
+        mount->cache->limit = size;
+        _romfsCacheMakeRoom(mount->cache, 0);
+    }
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return 0;
+}
+
+int32_t romfsSetPinBudget(const char *name, uint32_t size) {
+    romfs_mount *mount = _romfsGetMount(name);
+    if (mount == NULL) {
+        return -1;
+    }
+    {
+        std::lock_guard<std::mutex> cacheLock(mount->cache->lock);
+        mount->cache->pinLimit = size;
+    }
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return 0;
+}
+
+static int comparePathsFolded(const char *a, uint32_t lenA, const char *b, uint32_t lenB) {
+    uint32_t len = MIN(lenA, lenB);
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t c1 = normalizePathChar(a[i]);
+        uint8_t c2 = normalizePathChar(b[i]);
+        if (c1 != c2) {
+            return c1 < c2 ? -1 : 1;
+        }
+    }
+    return lenA == lenB ? 0 : (lenA < lenB ? -1 : 1);
+}
+
+static bool _romfsIndexDir(romfs_mount *mount, romfs_path_index *index, romfs_dir *dir, std::string &prefix, uint32_t depth) {
+    if (depth > PATH_MAX / 2) {
+        return false;
+    }
+    size_t prefixLen = prefix.size();
+
+    uint32_t offset = dir->childFile;
+    while (offset != romFS_none) {
+        romfs_file *file = romFS_file(mount, offset);
+        if (!file) { return false; }
+        index->entries.push_back({(uint32_t) index->paths.size(), (uint32_t) (prefixLen + 1 + file->nameLen), offset});
+        index->paths.append(prefix).append("/").append((const char *) file->name, file->nameLen).push_back('\0');
+        offset = file->sibling;
+    }
+
+    offset = dir->childDir;
+    while (offset != romFS_none) {
+        romfs_dir *child = romFS_dir(mount, offset);
+        if (!child) { return false; }
+        prefix.append("/").append((const char *) child->name, child->nameLen);
+        bool ok = _romfsIndexDir(mount, index, child, prefix, depth + 1);
+        prefix.resize(prefixLen);
+        if (!ok) { return false; }
+        offset = child->sibling;
+    }
+    return true;
+}
+
+static romfs_path_index *_romfsBuildPathIndex(romfs_mount *mount) {
+    auto *index = new romfs_path_index();
+    std::string prefix;
+    if (!_romfsIndexDir(mount, index, romFS_root(mount), prefix, 0)) {
+        delete index;
+        return nullptr;
+    }
+    const char *paths = index->paths.c_str();
+    std::sort(index->entries.begin(), index->entries.end(), [paths](const romfs_path_entry &a, const romfs_path_entry &b) {
+        return comparePathsFolded(paths + a.pathOff, a.pathLen, paths + b.pathOff, b.pathLen) < 0;
+    });
+    return index;
 }
 
-static int searchForFile(romfs_mount *mount, romfs_dir *parent, const uint8_t *name, uint32_t namelen, romfs_file **out) {
-    uint64_t parentOff  = (uintptr_t) parent - (uintptr_t) mount->dirTable;
-    uint32_t hash       = calcHash(parentOff, name, namelen, mount->header.fileHashTableSize / 4);
-    romfs_file *curFile = NULL;
-    uint32_t curOff;
-    *out = NULL;
-    for (curOff = mount->fileHashTable[hash]; curOff != romFS_none;
-         curOff = curFile->nextHash) {
-        curFile = romFS_file(mount, curOff);
-        if (curFile == NULL) {
-            return EFAULT;
+// Builds the index on first use. The caller must hold the mount's metadata, the index is freed along with it.
+static romfs_path_index *_romfsGetPathIndex(romfs_mount *mount) {
+    OSLockMutex(&mount->meta_mutex);
+    if (mount->pathIndex == nullptr) {
+        mount->pathIndex = _romfsBuildPathIndex(mount);
+    }
+    romfs_path_index *index = mount->pathIndex;
+    OSUnlockMutex(&mount->meta_mutex);
+    return index;
+}
+
+// Case-insensitive glob match. '*' and '?' don't match '/', '**' matches across directories.
+static bool globMatch(const char *pattern, const char *path) {
+    while (*pattern) {
+        if (pattern[0] == '*' && pattern[1] == '*') {
+            pattern += 2;
+            // "**/" also matches no directory at all
+            if (*pattern == '/' && globMatch(pattern + 1, path)) {
+                return true;
+            }
+            for (const char *p = path;; p++) {
+                if (globMatch(pattern, p)) {
+                    return true;
+                }
+                if (!*p) {
+                    return false;
+                }
+            }
         }
-        if (curFile->parent != parentOff) {
-            continue;
+        if (*pattern == '*') {
+            pattern++;
+            for (const char *p = path;; p++) {
+                if (globMatch(pattern, p)) {
+                    return true;
+                }
+                if (!*p || *p == '/') {
+                    return false;
+                }
+            }
         }
-        if (curFile->nameLen != namelen) {
-            continue;
+        if (!*path) {
+            return false;
         }
-        if (!comparePaths(curFile->name, name, namelen)) {
-            continue;
+        if (*pattern == '?') {
+            if (*path == '/') {
+                return false;
+            }
+        } else if (*pattern == '[') {
+            const char *p = pattern + 1;
+            bool negate   = (*p == '!' || *p == '^');
+            if (negate) { p++; }
+            bool found = false;
+            uint8_t c  = normalizePathChar(*path);
+            for (; *p && (*p != ']' || p == pattern + 1 + negate); p++) {
+                if (p[1] == '-' && p[2] && p[2] != ']') {
+                    if (c >= normalizePathChar(p[0]) && c <= normalizePathChar(p[2])) { found = true; }
+                    p += 2;
+                } else if (c == normalizePathChar(*p)) {
+                    found = true;
+                }
+            }
+            if (!*p || found == negate || *path == '/') {
+                return false;
+            }
+            pattern = p;
+        } else if (normalizePathChar(*pattern) != normalizePathChar(*path)) {
+            return false;
         }
-        *out = curFile;
-        return 0;
+        pattern++;
+        path++;
     }
-    return ENOENT;
+    return !*path;
 }
 
-static int navigateToDir(romfs_mount *mount, romfs_dir **ppDir, const char **pPath, bool isDir) {
-    char *colonPos = strchr(*pPath, ':');
-    if (colonPos) { *pPath = colonPos + 1; }
-    if (!**pPath) {
-        return EILSEQ;
+static int32_t _romfsQueryMount(romfs_mount *mount, const char *pattern, romfs_query_callback callback, void *userdata) {
+    // keeps the tables and the index alive while the callback runs
+    romfs_metadata_guard guard(mount);
+    if (guard.error != 0) {
+        return -3;
     }
-
-    *ppDir = mount->cwd;
-    if (**pPath == '/') {
-        *ppDir = romFS_root(mount);
-        (*pPath)++;
+    romfs_path_index *index = _romfsGetPathIndex(mount);
+    if (index == nullptr) {
+        return -3;
     }
 
-    OSLockMutex(&mount->cafe_mutex);
-    while (**pPath) {
-        char *slashPos  = strchr(*pPath, '/');
-        char *component = __component;
+    std::string absPattern = pattern[0] == '/' ? pattern : std::string("/") + pattern;
 
-        if (slashPos) {
-            uint32_t len = slashPos - *pPath;
-            if (!len) {
-                OSUnlockMutex(&mount->cafe_mutex);
-                return EILSEQ;
-            }
-            if (len > PATH_MAX) {
-                OSUnlockMutex(&mount->cafe_mutex);
-                return ENAMETOOLONG;
-            }
+    // only the range of paths starting with the literal part of the pattern needs to be matched
+    size_t literalLen  = strcspn(absPattern.c_str(), "*?[");
+    const char *paths  = index->paths.c_str();
+    const char *prefix = absPattern.c_str();
+    auto it            = std::lower_bound(index->entries.begin(), index->entries.end(), 0, [paths, prefix, literalLen](const romfs_path_entry &e, int) {
+        return comparePathsFolded(paths + e.pathOff, MIN(e.pathLen, literalLen), prefix, literalLen) < 0;
+    });
 
-            memcpy(component, *pPath, len);
-            component[len] = 0;
-            *pPath         = slashPos + 1;
-        } else if (isDir) {
-            component = (char *) *pPath;
-            *pPath += strlen(component);
-        } else {
-            OSUnlockMutex(&mount->cafe_mutex);
-            return 0;
+    int32_t matches = 0;
+    for (; it != index->entries.end(); ++it) {
+        const char *path = paths + it->pathOff;
+        if (it->pathLen < literalLen || comparePathsFolded(path, literalLen, prefix, literalLen) != 0) {
+            break;
         }
-
-        if (component[0] == '.') {
-            if (!component[1]) { continue; }
-            if (component[1] == '.' && !component[2]) {
-                *ppDir = romFS_dir(mount, (*ppDir)->parent);
-                if (!*ppDir) {
-                    OSUnlockMutex(&mount->cafe_mutex);
-                    return EFAULT;
-                }
-                continue;
-            }
+        if (!globMatch(absPattern.c_str(), path)) {
+            continue;
         }
-
-        int ret = searchForDir(mount, *ppDir, (uint8_t *) component, strlen(component), ppDir);
-        if (ret != 0) {
-            OSUnlockMutex(&mount->cafe_mutex);
-            return ret;
+        romfs_file *file = romFS_file(mount, it->fileOff);
+        romfs_fileInfo info;
+        info.length = file->dataSize;
+        info.offset = mount->header.fileDataOff + file->dataOff;
+        matches++;
+        if (!callback(path, &info, userdata)) {
+            break;
         }
     }
-    OSUnlockMutex(&mount->cafe_mutex);
-
-    return 0;
+    return matches;
 }
 
-static ino_t dir_inode(romfs_mount *mount, romfs_dir *dir) {
-    return (uint32_t *) dir - (uint32_t *) mount->dirTable;
+int32_t romfsQuery(const char *name, const char *pattern, romfs_query_callback callback, void *userdata) {
+    if (pattern == nullptr || callback == nullptr) {
+        return -1;
+    }
+    romfs_mount *mount = _romfsGetMount(name);
+    if (mount == nullptr) {
+        OSMemoryBarrier();
+        return -1;
+    }
+    int32_t matches = _romfsQueryMount(mount, pattern, callback, userdata);
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return matches;
 }
 
-static off_t dir_size(romfs_dir *dir) {
-    return sizeof(romfs_dir) + (dir->nameLen + 3) / 4;
-}
+typedef struct {
+    romfs_fileInfo *out;
+    uint32_t max;
+    uint32_t count;
+} romfs_query_bulk;
 
-static nlink_t dir_nlink(romfs_mount *mount, romfs_dir *dir) {
-    nlink_t count   = 2; // one for self, one for parent
-    uint32_t offset = dir->childDir;
+int32_t romfsQueryFileInfo(const char *name, const char *pattern, romfs_fileInfo *out, uint32_t maxEntries) {
+    if (out == nullptr && maxEntries != 0) {
+        return -1;
+    }
+    romfs_query_bulk bulk = {out, maxEntries, 0};
+    return romfsQuery(
+            name, pattern, [](const char *, const romfs_fileInfo *info, void *userdata) {
+                auto *bulk = (romfs_query_bulk *) userdata;
+                if (bulk->count < bulk->max) {
+                    bulk->out[bulk->count] = *info;
+                }
+                bulk->count++;
+                return true;
+            },
+            &bulk);
+}
 
-    while (offset != romFS_none) {
-        romfs_dir *tmp = romFS_dir(mount, offset);
-        if (!tmp) { break; }
-        ++count;
-        offset = tmp->sibling;
+// Writes out buffered trace lines. Must be called with trace->lock held.
+static void _romfsTraceFlush(romfs_trace *trace) {
+    const char *data = trace->buffer.data();
+    size_t left      = trace->buffer.size();
+    while (left != 0 && !trace->failed) {
+        ssize_t res = write(trace->fd, data, left);
+        if (res <= 0) {
+            trace->failed = true;
+            break;
+        }
+        data += res;
+        left -= res;
     }
+    trace->buffer.clear();
+}
 
-    offset = dir->childFile;
-    while (offset != romFS_none) {
-        romfs_file *tmp = romFS_file(mount, offset);
-        if (!tmp) { break; }
-        ++count;
-        offset = tmp->sibling;
+static void _romfsTraceLine(romfs_mount *mount, const char *format, ...) {
+    romfs_trace *trace = __atomic_load_n(&mount->trace, __ATOMIC_SEQ_CST);
+    if (trace == nullptr) {
+        return;
+    }
+    char line[PATH_MAX + 64];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0) {
+        return;
     }
 
-    return count;
+    std::lock_guard<std::mutex> lock(trace->lock);
+    if (trace->fd < 0) {
+        return;
+    }
+    trace->buffer.append(line, MIN((size_t) len, sizeof(line) - 1));
+    if (trace->buffer.size() >= ROMFS_TRACE_FLUSH_SIZE) {
+        _romfsTraceFlush(trace);
+    }
 }
 
-static ino_t file_inode(romfs_mount *mount, romfs_file *file) {
-    return ((uint32_t *) file - (uint32_t *) mount->fileTable) + mount->header.dirTableSize / 4;
+static void _romfsTraceOpen(romfs_mount *mount, romfs_file *file, uint32_t fileOff) {
+    if (__atomic_load_n(&mount->trace, __ATOMIC_SEQ_CST) == nullptr) {
+        return;
+    }
+    std::string path;
+    if (!_romfsDirPath(mount, file->parent, path, 0)) {
+        return;
+    }
+    path.append("/").append((const char *) file->name, file->nameLen);
+    _romfsTraceLine(mount, "open %u %s\n", fileOff, path.c_str());
 }
 
-int romfsGetFileInfoPerPath(const char *romfs, const char *path, romfs_fileInfo *out) {
-    std::lock_guard<std::mutex> lock(romfsMutex);
-    if (out == nullptr) {
-        return -1;
+int32_t romfsStartTrace(const char *name, const char *logPath) {
+    if (logPath == nullptr) {
+        return -2;
     }
-    auto *mount = (romfs_mount *) romfsFindMount(romfs);
+    romfs_mount *mount = _romfsGetMount(name);
     if (mount == nullptr) {
-        OSMemoryBarrier();
-        return -2;
+        return -1;
     }
-    romfs_dir *curDir = nullptr;
-    int errno2        = navigateToDir(mount, &curDir, &path, false);
-    if (errno2 != 0) {
-        OSMemoryBarrier();
-        return -3;
+
+    int32_t res = 0;
+    OSLockMutex(&mount->meta_mutex);
+    if (mount->trace == nullptr) {
+        // kept until the mount is gone, readers access it without holding a lock
+        mount->trace     = new romfs_trace();
+        mount->trace->fd = -1;
     }
-    romfs_file *file = nullptr;
-    int err          = searchForFile(mount, curDir, (uint8_t *) path, strlen(path), &file);
-    if (err != 0) {
-        OSMemoryBarrier();
-        return -4;
+    {
+        std::lock_guard<std::mutex> lock(mount->trace->lock);
+        if (mount->trace->fd >= 0) {
+            res = -3;
+        } else {
+            mount->trace->fd     = open(logPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            mount->trace->failed = false;
+            if (mount->trace->fd < 0) {
+                res = -2;
+            } else {
+                mount->trace->buffer = "# romfs trace " + std::string(mount->name) + "\n";
+            }
+        }
     }
+    OSUnlockMutex(&mount->meta_mutex);
 
-    out->length = file->dataSize;
-    out->offset = mount->header.fileDataOff + file->dataOff;
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return res;
+}
 
-    return 0;
+// Flushes and closes the log. Returns 0, -1 if no trace is running or -2 if writing the log failed.
+static int32_t _romfsStopTrace(romfs_trace *trace) {
+    std::lock_guard<std::mutex> lock(trace->lock);
+    if (trace->fd < 0) {
+        return -1;
+    }
+    _romfsTraceFlush(trace);
+    bool ok   = !trace->failed && close(trace->fd) == 0;
+    trace->fd = -1;
+    return ok ? 0 : -2;
+}
+
+int32_t romfsStopTrace(const char *name) {
+    romfs_mount *mount = _romfsGetMount(name);
+    if (mount == nullptr) {
+        return -1;
+    }
+    romfs_trace *trace = __atomic_load_n(&mount->trace, __ATOMIC_SEQ_CST);
+    int32_t res        = trace != nullptr ? _romfsStopTrace(trace) : -1;
+    _romfsReleaseMount(mount);
+    OSMemoryBarrier();
+    return res;
+}
+
+static void _romfsDestroyTrace(romfs_mount *mount) {
+    if (mount->trace == nullptr) {
+        return;
+    }
+    _romfsStopTrace(mount->trace);
+    delete mount->trace;
+    mount->trace = nullptr;
 }
 
 //-----------------------------------------------------------------------------
 
 int romfs_open(struct _reent *r, void *fileStruct, const char *path, int flags, int mode) {
-    std::lock_guard<std::mutex> lock(romfsMutex);
+    romfs_read_section section;
     romfs_fileobj *fileobj = (romfs_fileobj *) fileStruct;
 
-    fileobj->mount = (romfs_mount *) r->deviceData;
+    fileobj->mount = _romfsDeviceMount(r);
+    if (fileobj->mount == nullptr) {
+        r->_errno = ENODEV;
+        OSMemoryBarrier();
+        return -1;
+    }
 
     if ((flags & O_ACCMODE) != O_RDONLY) {
         r->_errno = EROFS;
@@ -646,60 +3374,91 @@ int romfs_open(struct _reent *r, void *fileStruct, const char *path, int flags,
         return -1;
     }
 
+    romfs_metadata_guard guard(fileobj->mount);
     romfs_dir *curDir = NULL;
-    r->_errno         = navigateToDir(fileobj->mount, &curDir, &path, false);
-    if (r->_errno != 0) {
+    romfs_file *file  = NULL;
+    if (guard.error == 0 && _romfsLookupPath(fileobj->mount, path, &curDir, &file) == 0) {
+        r->_errno = (flags & O_CREAT) ? EROFS : ENOENT;
         OSMemoryBarrier();
         return -1;
     }
+    if (file == NULL) {
+        r->_errno = guard.error != 0 ? guard.error : navigateToDir(fileobj->mount, &curDir, &path, false);
+        if (r->_errno != 0) {
+            OSMemoryBarrier();
+            return -1;
+        }
 
-    romfs_file *file = NULL;
-    int ret          = searchForFile(fileobj->mount, curDir, (uint8_t *) path, strlen(path), &file);
-    if (ret != 0) {
-        if (ret == ENOENT && (flags & O_CREAT)) {
-            r->_errno = EROFS;
-        } else {
-            r->_errno = ret;
+        int ret = searchForFile(fileobj->mount, curDir, (uint8_t *) path, strlen(path), &file);
+        if (ret != 0) {
+            if (ret == ENOENT && (flags & O_CREAT)) {
+                r->_errno = EROFS;
+            } else {
+                r->_errno = ret;
+            }
+            return -1;
         }
-        return -1;
-    } else if ((flags & O_CREAT) && (flags & O_EXCL)) {
+    }
+    if ((flags & O_CREAT) && (flags & O_EXCL)) {
         r->_errno = EEXIST;
         OSMemoryBarrier();
         return -1;
     }
 
-    fileobj->file   = file;
-    fileobj->offset = fileobj->mount->header.fileDataOff + file->dataOff;
-    fileobj->pos    = 0;
-
+    // only copies are kept so the file stays usable if the metadata is evicted
+    fileobj->fileOff  = (uintptr_t) file - (uintptr_t) fileobj->mount->fileTable;
+    fileobj->dataSize = file->dataSize;
+    fileobj->offset   = fileobj->mount->header.fileDataOff + file->dataOff;
+    fileobj->pos      = 0;
+    fileobj->advice   = RomfsAdvice_Normal;
+    fileobj->priority = RomfsPriority_Normal;
+    _romfsTraceOpen(fileobj->mount, file, fileobj->fileOff);
+
+    // the file keeps the mount alive until it is closed
+    _romfsRetainMount(fileobj->mount);
     OSMemoryBarrier();
     return 0;
 }
 
+// Keeps the two readahead windows following the current position queued.
+static void _romfsReadahead(romfs_fileobj *file) {
+    uint64_t window = 2 * (uint64_t) _romfsReadChunkSize(file->mount);
+    uint64_t start  = (file->pos / window) * window;
+    for (int i = 0; i < 2 && start < file->dataSize; i++, start += window) {
+        _romfsCachePrefetch(file->mount, file->offset + start, MIN(window, file->dataSize - start), file->priority);
+    }
+}
+
 int romfs_close(struct _reent *r, void *fd) {
+    romfs_fileobj *file = (romfs_fileobj *) fd;
+    _romfsReleaseMount(file->mount);
     return 0;
 }
 
 ssize_t romfs_read(struct _reent *r, void *fd, char *ptr, size_t len) {
-    std::lock_guard<std::mutex> lock(romfsMutex);
+    // No global lock here, the open file keeps the client pool alive and concurrent readers are spread over it.
     romfs_fileobj *file = (romfs_fileobj *) fd;
     uint64_t endPos     = file->pos + len;
 
     /* check if past end-of-file */
-    if (file->pos >= file->file->dataSize) {
+    if (file->pos >= file->dataSize) {
         OSMemoryBarrier();
         return 0;
     }
 
     /* truncate the read to end-of-file */
-    if (endPos > file->file->dataSize) {
-        endPos = file->file->dataSize;
+    if (endPos > file->dataSize) {
+        endPos = file->dataSize;
     }
     len = endPos - file->pos;
 
-    ssize_t adv = _romfs_read(file->mount, file->offset + file->pos, ptr, len);
+    _romfsTraceLine(file->mount, "read %u %llu %u\n", file->fileOff, (unsigned long long) file->pos, (uint32_t) len);
+    ssize_t adv = _romfs_read_cached(file->mount, file->offset + file->pos, ptr, len, file->priority);
     if (adv >= 0) {
         file->pos += adv;
+        if (file->advice == RomfsAdvice_Sequential) {
+            _romfsReadahead(file);
+        }
         OSMemoryBarrier();
         return adv;
     }
@@ -710,7 +3469,6 @@ ssize_t romfs_read(struct _reent *r, void *fd, char *ptr, size_t len) {
 }
 
 off_t romfs_seek(struct _reent *r, void *fd, off_t pos, int dir) {
-    std::lock_guard<std::mutex> lock(romfsMutex);
     romfs_fileobj *file = (romfs_fileobj *) fd;
     off_t start;
     switch (dir) {
@@ -723,7 +3481,7 @@ off_t romfs_seek(struct _reent *r, void *fd, off_t pos, int dir) {
             break;
 
         case SEEK_END:
-            start = file->file->dataSize;
+            start = file->dataSize;
             break;
 
         default:
@@ -763,31 +3521,51 @@ static void fillDir(struct stat *st, romfs_mount *mount, romfs_dir *dir) {
     st->st_atime = st->st_mtime = st->st_ctime = mount->mtime;
 }
 
-static void fillFile(struct stat *st, romfs_mount *mount, romfs_file *file) {
+static void fillFile(struct stat *st, romfs_mount *mount, uint32_t fileOff, uint64_t dataSize) {
     memset(st, 0, sizeof(struct stat));
-    st->st_ino     = file_inode(mount, file);
+    st->st_ino     = file_inode(mount, fileOff);
     st->st_mode    = romFS_file_mode;
     st->st_nlink   = 1;
-    st->st_size    = (off_t) file->dataSize;
+    st->st_size    = (off_t) dataSize;
     st->st_blksize = 512;
     st->st_blocks  = (st->st_blksize + 511) / 512;
     st->st_atime = st->st_mtime = st->st_ctime = mount->mtime;
 }
 
 int romfs_fstat(struct _reent *r, void *fd, struct stat *st) {
-    std::lock_guard<std::mutex> lock(romfsMutex);
     romfs_fileobj *fileobj = (romfs_fileobj *) fd;
-    fillFile(st, fileobj->mount, fileobj->file);
+    fillFile(st, fileobj->mount, fileobj->fileOff, fileobj->dataSize);
 
     OSMemoryBarrier();
     return 0;
 }
 
 int romfs_stat(struct _reent *r, const char *path, struct stat *st) {
-    std::lock_guard<std::mutex> lock(romfsMutex);
-    romfs_mount *mount = (romfs_mount *) r->deviceData;
-    romfs_dir *curDir  = NULL;
-    r->_errno          = navigateToDir(mount, &curDir, &path, false);
+    romfs_read_section section;
+    romfs_mount *mount = _romfsDeviceMount(r);
+    if (mount == nullptr) {
+        r->_errno = ENODEV;
+        OSMemoryBarrier();
+        return -1;
+    }
+    romfs_metadata_guard guard(mount);
+    romfs_dir *curDir = NULL;
+    romfs_file *found = NULL;
+    switch (guard.error == 0 ? _romfsLookupPath(mount, path, &curDir, &found) : -1) {
+        case 0:
+            r->_errno = ENOENT;
+            OSMemoryBarrier();
+            return -1;
+        case 1:
+            if (curDir != NULL) {
+                fillDir(st, mount, curDir);
+            } else {
+                fillFile(st, mount, (uintptr_t) found - (uintptr_t) mount->fileTable, found->dataSize);
+            }
+            OSMemoryBarrier();
+            return 0;
+    }
+    r->_errno = guard.error != 0 ? guard.error : navigateToDir(mount, &curDir, &path, false);
     if (r->_errno != 0) {
         OSMemoryBarrier();
         return -1;
@@ -821,7 +3599,7 @@ int romfs_stat(struct _reent *r, const char *path, struct stat *st) {
         return -1;
     }
     if (ret == 0) {
-        fillFile(st, mount, file);
+        fillFile(st, mount, (uintptr_t) file - (uintptr_t) mount->fileTable, file->dataSize);
         OSMemoryBarrier();
         return 0;
     }
@@ -832,61 +3610,112 @@ int romfs_stat(struct _reent *r, const char *path, struct stat *st) {
 }
 
 int romfs_chdir(struct _reent *r, const char *path) {
-    std::lock_guard<std::mutex> lock(romfsMutex);
-    romfs_mount *mount = (romfs_mount *) r->deviceData;
-    romfs_dir *curDir  = NULL;
-    r->_errno          = navigateToDir(mount, &curDir, &path, true);
+    romfs_read_section section;
+    romfs_mount *mount = _romfsDeviceMount(r);
+    if (mount == nullptr) {
+        r->_errno = ENODEV;
+        OSMemoryBarrier();
+        return -1;
+    }
+    romfs_metadata_guard guard(mount);
+    romfs_dir *curDir = NULL;
+    r->_errno         = guard.error != 0 ? guard.error : navigateToDir(mount, &curDir, &path, true);
     if (r->_errno != 0) {
         OSMemoryBarrier();
         return -1;
     }
 
-    mount->cwd = curDir;
+    // relative lookups hash the path starting from here
+    romfs_path_hash cwdHash;
+    std::string cwdPath;
+    _romfsPathHashInit(&cwdHash);
+    if (_romfsDirPath(mount, (uintptr_t) curDir - (uintptr_t) mount->dirTable, cwdPath, 0)) {
+        for (size_t pos = 1; pos < cwdPath.size();) {
+            size_t end = cwdPath.find('/', pos);
+            end        = end == std::string::npos ? cwdPath.size() : end;
+            _romfsPathHashAppend(&cwdHash, (const uint8_t *) cwdPath.data() + pos, end - pos);
+            pos = end + 1;
+        }
+    }
+
+    mount->cwd     = (uintptr_t) curDir - (uintptr_t) mount->dirTable;
+    mount->cwdHash = cwdHash;
     OSMemoryBarrier();
     return 0;
 }
 
 DIR_ITER *romfs_diropen(struct _reent *r, DIR_ITER *dirState, const char *path) {
-    std::lock_guard<std::mutex> lock(romfsMutex);
+    romfs_read_section section;
     romfs_diriter *iter = (romfs_diriter *) (dirState->dirStruct);
     romfs_dir *curDir   = NULL;
-    iter->mount         = (romfs_mount *) r->deviceData;
+    iter->mount         = _romfsDeviceMount(r);
+    if (iter->mount == nullptr) {
+        r->_errno = ENODEV;
+        OSMemoryBarrier();
+        return NULL;
+    }
 
-    r->_errno = navigateToDir(iter->mount, &curDir, &path, true);
-    if (r->_errno != 0) {
+    romfs_metadata_guard guard(iter->mount);
+    romfs_file *file = NULL;
+    int found        = guard.error == 0 ? _romfsLookupPath(iter->mount, path, &curDir, &file) : -1;
+    if (found == 0) {
+        r->_errno = ENOENT;
         OSMemoryBarrier();
         return NULL;
     }
+    if (curDir == NULL) {
+        r->_errno = guard.error != 0 ? guard.error : navigateToDir(iter->mount, &curDir, &path, true);
+        if (r->_errno != 0) {
+            OSMemoryBarrier();
+            return NULL;
+        }
+    }
 
-    iter->dir       = curDir;
+    iter->dirOff    = (uintptr_t) curDir - (uintptr_t) iter->mount->dirTable;
     iter->state     = 0;
     iter->childDir  = curDir->childDir;
     iter->childFile = curDir->childFile;
 
+    // the iterator keeps the mount alive until it is closed
+    _romfsRetainMount(iter->mount);
     OSMemoryBarrier();
     return dirState;
 }
 
 int romfs_dirreset(struct _reent *r, DIR_ITER *dirState) {
-    std::lock_guard<std::mutex> lock(romfsMutex);
     romfs_diriter *iter = (romfs_diriter *) (dirState->dirStruct);
 
+    romfs_metadata_guard guard(iter->mount);
+    r->_errno = guard.error;
+    if (r->_errno != 0) {
+        OSMemoryBarrier();
+        return -1;
+    }
+    romfs_dir *curDir = romFS_dir(iter->mount, iter->dirOff);
+
     iter->state     = 0;
-    iter->childDir  = iter->dir->childDir;
-    iter->childFile = iter->dir->childFile;
+    iter->childDir  = curDir->childDir;
+    iter->childFile = curDir->childFile;
 
     OSMemoryBarrier();
     return 0;
 }
 
 int romfs_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, struct stat *filestat) {
-    std::lock_guard<std::mutex> lock(romfsMutex);
     romfs_diriter *iter = (romfs_diriter *) (dirState->dirStruct);
 
+    romfs_metadata_guard guard(iter->mount);
+    r->_errno = guard.error;
+    if (r->_errno != 0) {
+        OSMemoryBarrier();
+        return -1;
+    }
+    romfs_dir *curDir = romFS_dir(iter->mount, iter->dirOff);
+
     if (iter->state == 0) {
         /* '.' entry */
         memset(filestat, 0, sizeof(*filestat));
-        filestat->st_ino  = dir_inode(iter->mount, iter->dir);
+        filestat->st_ino  = dir_inode(iter->mount, curDir);
         filestat->st_mode = romFS_dir_mode;
 
         strcpy(filename, ".");
@@ -895,7 +3724,7 @@ int romfs_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, struct s
         return 0;
     } else if (iter->state == 1) {
         /* '..' entry */
-        romfs_dir *dir = romFS_dir(iter->mount, iter->dir->parent);
+        romfs_dir *dir = romFS_dir(iter->mount, curDir->parent);
         if (!dir) {
             r->_errno = EFAULT;
             OSMemoryBarrier();
@@ -946,10 +3775,9 @@ int romfs_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, struct s
             return -1;
         }
 
-        iter->childFile = file->sibling;
-
         memset(filestat, 0, sizeof(*filestat));
-        filestat->st_ino  = file_inode(iter->mount, file);
+        filestat->st_ino  = file_inode(iter->mount, iter->childFile);
+        iter->childFile   = file->sibling;
         filestat->st_mode = romFS_file_mode;
 
         memset(filename, 0, NAME_MAX);
@@ -972,5 +3800,87 @@ int romfs_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, struct s
 }
 
 int romfs_dirclose(struct _reent *r, DIR_ITER *dirState) {
+    romfs_diriter *iter = (romfs_diriter *) (dirState->dirStruct);
+    _romfsReleaseMount(iter->mount);
     return 0;
-}
\ No newline at end of file
+}
+
+static romfs_diriter *_romfsGetDirIter(DIR *dirp) {
+    if (dirp == nullptr || dirp->dirData == nullptr || dirp->dirData->dirStruct == nullptr) {
+        return nullptr;
+    }
+    const devoptab_t *device = devoptab_list[dirp->dirData->device];
+    if (device == nullptr || device->diropen_r != romfs_diropen) {
+        return nullptr;
+    }
+    return (romfs_diriter *) dirp->dirData->dirStruct;
+}
+
+int32_t romfsTellDir(DIR *dirp, uint64_t *pos) {
+    romfs_diriter *iter = _romfsGetDirIter(dirp);
+    if (iter == nullptr || pos == nullptr) {
+        return -1;
+    }
+    if (iter->state < 2) {
+        *pos = (uint64_t) (iter->state == 0 ? ROMFS_DIRPOS_DOT : ROMFS_DIRPOS_DOTDOT) << 32;
+    } else if (iter->childDir != romFS_none) {
+        *pos = ((uint64_t) ROMFS_DIRPOS_DIR << 32) | iter->childDir;
+    } else {
+        *pos = ((uint64_t) ROMFS_DIRPOS_FILE << 32) | iter->childFile;
+    }
+    return 0;
+}
+
+int32_t romfsSeekDir(DIR *dirp, uint64_t pos) {
+    romfs_diriter *iter = _romfsGetDirIter(dirp);
+    if (iter == nullptr) {
+        return -1;
+    }
+    romfs_metadata_guard guard(iter->mount);
+    if (guard.error != 0) {
+        OSMemoryBarrier();
+        return -2;
+    }
+    romfs_dir *curDir = romFS_dir(iter->mount, iter->dirOff);
+    uint32_t kind     = pos >> 32;
+    uint32_t offset   = (uint32_t) pos;
+
+    // only entries of this directory are accepted, so a stale or foreign position can't escape it
+    switch (kind) {
+        case ROMFS_DIRPOS_DOT:
+        case ROMFS_DIRPOS_DOTDOT:
+            if (offset != 0) {
+                return -3;
+            }
+            iter->state     = kind == ROMFS_DIRPOS_DOT ? 0 : 1;
+            iter->childDir  = curDir->childDir;
+            iter->childFile = curDir->childFile;
+            break;
+        case ROMFS_DIRPOS_DIR: {
+            romfs_dir *dir = romFS_dir(iter->mount, offset);
+            if (dir == nullptr || dir->parent != iter->dirOff || offset == iter->dirOff) {
+                return -3;
+            }
+            iter->state     = 2;
+            iter->childDir  = offset;
+            iter->childFile = curDir->childFile;
+            break;
+        }
+        case ROMFS_DIRPOS_FILE: {
+            if (offset != romFS_none) {
+                romfs_file *file = romFS_file(iter->mount, offset);
+                if (file == nullptr || file->parent != iter->dirOff) {
+                    return -3;
+                }
+            }
+            iter->state     = 2;
+            iter->childDir  = romFS_none;
+            iter->childFile = offset;
+            break;
+        }
+        default:
+            return -3;
+    }
+    OSMemoryBarrier();
+    return 0;
+}
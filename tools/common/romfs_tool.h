@@ -0,0 +1,43 @@
+/**
+ * @file romfs_tool.h
+ * @brief Helpers shared by the host tools.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+static inline uint32_t getBE32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline uint64_t getBE64(const uint8_t *p) {
+    return ((uint64_t) getBE32(p) << 32) | getBE32(p + 4);
+}
+
+static inline uint64_t alignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Must match normalizePathChar in source/romfs_dev.cpp, only ASCII letters are folded.
+static inline uint8_t normalizePathChar(uint8_t c) {
+    if (c >= 'a' && c <= 'z') {
+        return c + 'A' - 'a';
+    } else {
+        return c;
+    }
+}
+
+/// True if the names are equal after case folding, i.e. the driver can't tell them apart.
+static inline bool sameNameFolded(const std::string &a, const std::string &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (normalizePathChar(a[i]) != normalizePathChar(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,400 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "romfs_dev.h"
+#include "romfs_tool.h"
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define ROMFS_NONE            ((uint32_t) ~0)
+#define ROMFS_DEFAULT_ALIGN   0x40
+#define ROMFS_COPY_BLOCK_SIZE 0x100000
+
+// The image is read by casting the tables to these structs on a big-endian CPU.
+static_assert(sizeof(romfs_header) == 0x50, "unexpected romfs_header size");
+static_assert(sizeof(romfs_dir) == 0x18, "unexpected romfs_dir size");
+static_assert(sizeof(romfs_file) == 0x20, "unexpected romfs_file size");
+
+struct build_dir;
+
+struct build_file {
+    std::string name;
+    std::string hostPath;
+    build_dir *parent;
+    uint64_t size;
+    uint64_t dataOff;
+    uint32_t off;
+    uint32_t nextHash;
+};
+
+struct build_dir {
+    std::string name;
+    build_dir *parent;
+    std::vector<std::unique_ptr<build_dir>> dirs;
+    std::vector<std::unique_ptr<build_file>> files;
+    uint32_t off;
+    uint32_t nextHash;
+};
+
+struct build_image {
+    build_dir root;
+    std::vector<build_dir *> dirs;   ///< dir table order
+    std::vector<build_file *> files; ///< file table order
+    uint64_t alignment;
+    bool verbose;
+};
+
+// Must match calcHash in source/romfs_dev.cpp.
+static uint32_t calcHash(uint32_t parent, const std::string &name, uint32_t total) {
+    uint32_t hash = parent ^ 123456789;
+    for (uint8_t c : name) {
+        hash = (hash >> 5) | (hash << 27);
+        hash ^= normalizePathChar(c);
+    }
+    return hash % total;
+}
+
+static bool isPrime(uint32_t n) {
+    if (n < 2) { return false; }
+    for (uint32_t i = 2; (uint64_t) i * i <= n; i++) {
+        if (n % i == 0) { return false; }
+    }
+    return true;
+}
+
+// Twice as many buckets as entries keeps the nextHash chains at about one entry.
+// A prime count spreads the rotating hash over all buckets.
+static uint32_t hashTableCount(uint32_t entries) {
+    uint32_t count = std::max<uint32_t>(3, entries * 2);
+    while (!isPrime(count)) {
+        count++;
+    }
+    return count;
+}
+
+static uint32_t dirEntrySize(const build_dir *dir) {
+    return sizeof(romfs_dir) + alignUp(dir->name.size(), 4);
+}
+
+static uint32_t fileEntrySize(const build_file *file) {
+    return sizeof(romfs_file) + alignUp(file->name.size(), 4);
+}
+
+static void putBE32(std::vector<uint8_t> &out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back((uint8_t) (value >> shift));
+    }
+}
+
+static void putBE64(std::vector<uint8_t> &out, uint64_t value) {
+    putBE32(out, (uint32_t) (value >> 32));
+    putBE32(out, (uint32_t) value);
+}
+
+static void putName(std::vector<uint8_t> &out, const std::string &name) {
+    out.insert(out.end(), name.begin(), name.end());
+    out.resize(alignUp(out.size(), 4), 0);
+}
+
+static bool scanDir(build_dir *dir, const std::string &hostPath) {
+    DIR *handle = opendir(hostPath.c_str());
+    if (handle == nullptr) {
+        fprintf(stderr, "romfs_build: can't open %s: %s\n", hostPath.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::vector<std::string> names;
+    struct dirent *ent;
+    while ((ent = readdir(handle)) != nullptr) {
+        if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+            names.push_back(ent->d_name);
+        }
+    }
+    closedir(handle);
+    // sorted for reproducible images
+    std::sort(names.begin(), names.end());
+
+    for (auto &name : names) {
+        std::string path = hostPath + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            fprintf(stderr, "romfs_build: can't stat %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        if (name.size() >= 255) {
+            fprintf(stderr, "romfs_build: name too long: %s\n", path.c_str());
+            return false;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            for (auto &other : dir->dirs) {
+                if (sameNameFolded(other->name, name)) {
+                    // lookups are case-insensitive, only one of them could be found
+                    fprintf(stderr, "romfs_build: %s and %s only differ in case\n", other->name.c_str(), path.c_str());
+                    return false;
+                }
+            }
+            auto child    = std::make_unique<build_dir>();
+            child->name   = name;
+            child->parent = dir;
+            if (!scanDir(child.get(), path)) {
+                return false;
+            }
+            dir->dirs.push_back(std::move(child));
+        } else if (S_ISREG(st.st_mode)) {
+            for (auto &other : dir->files) {
+                if (sameNameFolded(other->name, name)) {
+                    fprintf(stderr, "romfs_build: %s and %s only differ in case\n", other->name.c_str(), path.c_str());
+                    return false;
+                }
+            }
+            auto file      = std::make_unique<build_file>();
+            file->name     = name;
+            file->hostPath = path;
+            file->parent   = dir;
+            file->size     = st.st_size;
+            dir->files.push_back(std::move(file));
+        } else {
+            fprintf(stderr, "romfs_build: skipping %s, not a regular file\n", path.c_str());
+        }
+    }
+    return true;
+}
+
+// Siblings get consecutive entries, so walking a directory touches as few cache lines as possible.
+static void layoutDir(build_image *image, build_dir *dir) {
+    for (auto &child : dir->dirs) {
+        image->dirs.push_back(child.get());
+    }
+    for (auto &file : dir->files) {
+        image->files.push_back(file.get());
+    }
+    for (auto &child : dir->dirs) {
+        layoutDir(image, child.get());
+    }
+}
+
+static bool layout(build_image *image) {
+    image->dirs.push_back(&image->root);
+    layoutDir(image, &image->root);
+
+    uint64_t off = 0;
+    for (auto *dir : image->dirs) {
+        dir->off = (uint32_t) off;
+        off += dirEntrySize(dir);
+    }
+    if (off > ROMFS_NONE) {
+        fprintf(stderr, "romfs_build: directory table too large\n");
+        return false;
+    }
+    off = 0;
+    for (auto *file : image->files) {
+        file->off = (uint32_t) off;
+        off += fileEntrySize(file);
+    }
+    if (off > ROMFS_NONE) {
+        fprintf(stderr, "romfs_build: file table too large\n");
+        return false;
+    }
+
+    // data is stored in file table order, every file starting on an aligned offset
+    uint64_t dataOff = 0;
+    for (auto *file : image->files) {
+        file->dataOff = alignUp(dataOff, image->alignment);
+        dataOff       = file->dataOff + file->size;
+    }
+    return true;
+}
+
+template<typename T>
+static std::vector<uint32_t> buildHashTable(const std::vector<T *> &entries, uint32_t *maxChain) {
+    std::vector<uint32_t> table(hashTableCount(entries.size()), ROMFS_NONE);
+    std::vector<uint32_t> chain(table.size(), 0);
+    *maxChain = 0;
+    for (auto *entry : entries) {
+        // the root directory is its own parent
+        uint32_t parentOff = entry->parent ? entry->parent->off : 0;
+        uint32_t hash      = calcHash(parentOff, entry->name, table.size());
+        entry->nextHash    = table[hash];
+        table[hash]        = entry->off;
+        *maxChain          = std::max(*maxChain, ++chain[hash]);
+    }
+    return table;
+}
+
+static uint32_t firstOf(const std::vector<std::unique_ptr<build_dir>> &dirs) {
+    return dirs.empty() ? ROMFS_NONE : dirs.front()->off;
+}
+
+static uint32_t firstOf(const std::vector<std::unique_ptr<build_file>> &files) {
+    return files.empty() ? ROMFS_NONE : files.front()->off;
+}
+
+template<typename T>
+static uint32_t siblingOf(const std::vector<std::unique_ptr<T>> &list, const T *entry) {
+    for (size_t i = 0; i + 1 < list.size(); i++) {
+        if (list[i].get() == entry) {
+            return list[i + 1]->off;
+        }
+    }
+    return ROMFS_NONE;
+}
+
+static bool copyData(FILE *out, build_file *file, uint64_t *written) {
+    FILE *in = fopen(file->hostPath.c_str(), "rb");
+    if (in == nullptr) {
+        fprintf(stderr, "romfs_build: can't open %s: %s\n", file->hostPath.c_str(), strerror(errno));
+        return false;
+    }
+    std::vector<uint8_t> buffer(ROMFS_COPY_BLOCK_SIZE);
+    uint64_t left = file->size;
+    while (left != 0) {
+        size_t len = fread(buffer.data(), 1, std::min<uint64_t>(left, buffer.size()), in);
+        if (len == 0) {
+            fprintf(stderr, "romfs_build: %s changed while building the image\n", file->hostPath.c_str());
+            fclose(in);
+            return false;
+        }
+        if (fwrite(buffer.data(), 1, len, out) != len) {
+            fclose(in);
+            return false;
+        }
+        left -= len;
+        *written += len;
+    }
+    fclose(in);
+    return true;
+}
+
+static bool writeImage(build_image *image, const char *outPath) {
+    uint32_t dirChain, fileChain;
+    std::vector<uint32_t> dirHash  = buildHashTable(image->dirs, &dirChain);
+    std::vector<uint32_t> fileHash = buildHashTable(image->files, &fileChain);
+
+    std::vector<uint8_t> dirTable;
+    for (auto *dir : image->dirs) {
+        putBE32(dirTable, dir->parent ? dir->parent->off : 0);
+        putBE32(dirTable, dir->parent ? siblingOf(dir->parent->dirs, dir) : ROMFS_NONE);
+        putBE32(dirTable, firstOf(dir->dirs));
+        putBE32(dirTable, firstOf(dir->files));
+        putBE32(dirTable, dir->nextHash);
+        putBE32(dirTable, dir->name.size());
+        putName(dirTable, dir->name);
+    }
+
+    std::vector<uint8_t> fileTable;
+    for (auto *file : image->files) {
+        putBE32(fileTable, file->parent->off);
+        putBE32(fileTable, siblingOf(file->parent->files, file));
+        putBE64(fileTable, file->dataOff);
+        putBE64(fileTable, file->size);
+        putBE32(fileTable, file->nextHash);
+        putBE32(fileTable, file->name.size());
+        putName(fileTable, file->name);
+    }
+
+    // all metadata directly follows the header so it can be loaded in one go
+    std::vector<uint8_t> meta;
+    uint64_t dirHashOff   = sizeof(romfs_header);
+    uint64_t dirTableOff  = dirHashOff + dirHash.size() * 4;
+    uint64_t fileHashOff  = dirTableOff + dirTable.size();
+    uint64_t fileTableOff = fileHashOff + fileHash.size() * 4;
+    uint64_t fileDataOff  = alignUp(fileTableOff + fileTable.size(), image->alignment);
+
+    meta.insert(meta.end(), {'W', 'U', 'H', 'B'});
+    putBE32(meta, sizeof(romfs_header));
+    putBE64(meta, dirHashOff);
+    putBE64(meta, dirHash.size() * 4);
+    putBE64(meta, dirTableOff);
+    putBE64(meta, dirTable.size());
+    putBE64(meta, fileHashOff);
+    putBE64(meta, fileHash.size() * 4);
+    putBE64(meta, fileTableOff);
+    putBE64(meta, fileTable.size());
+    putBE64(meta, fileDataOff);
+    for (uint32_t off : dirHash) {
+        putBE32(meta, off);
+    }
+    meta.insert(meta.end(), dirTable.begin(), dirTable.end());
+    for (uint32_t off : fileHash) {
+        putBE32(meta, off);
+    }
+    meta.insert(meta.end(), fileTable.begin(), fileTable.end());
+    meta.resize(fileDataOff, 0);
+
+    FILE *out = fopen(outPath, "wb");
+    if (out == nullptr) {
+        fprintf(stderr, "romfs_build: can't create %s: %s\n", outPath, strerror(errno));
+        return false;
+    }
+    bool ok = fwrite(meta.data(), 1, meta.size(), out) == meta.size();
+
+    uint64_t written = 0;
+    static const uint8_t padding[0x1000] = {};
+    for (auto *file : image->files) {
+        if (!ok) {
+            break;
+        }
+        // alignment is capped at 0x1000 by the option parser
+        uint64_t pad = file->dataOff - written;
+        ok           = fwrite(padding, 1, pad, out) == pad;
+        written += pad;
+        ok = ok && copyData(out, file, &written);
+    }
+    if (fclose(out) != 0 || !ok) {
+        fprintf(stderr, "romfs_build: writing %s failed\n", outPath);
+        remove(outPath);
+        return false;
+    }
+
+    if (image->verbose) {
+        printf("%zu directories, %zu files, image size %llu bytes\n", image->dirs.size(), image->files.size(), (unsigned long long) (fileDataOff + written));
+        printf("header and metadata: %llu bytes, longest hash chain: %u (dirs), %u (files)\n", (unsigned long long) fileDataOff, dirChain, fileChain);
+    }
+    return true;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: romfs_build [-a alignment] [-v] <input dir> <output.wuhb>\n"
+                    "  -a  alignment of file data in bytes, a power of two up to 4096 (default 64)\n"
+                    "  -v  print statistics about the image\n");
+}
+
+int main(int argc, char **argv) {
+    build_image image;
+    image.alignment = ROMFS_DEFAULT_ALIGN;
+    image.verbose   = false;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            char *end;
+            image.alignment = strtoull(argv[++i], &end, 0);
+            if (*end || image.alignment == 0 || image.alignment > 0x1000 || (image.alignment & (image.alignment - 1)) != 0) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-v") == 0) {
+            image.verbose = true;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (argc - i != 2) {
+        usage();
+        return 1;
+    }
+
+    image.root.parent = nullptr;
+    if (!scanDir(&image.root, argv[i]) || !layout(&image) || !writeImage(&image, argv[i + 1])) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,328 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "romfs_dev.h"
+#include "romfs_tool.h"
+#include <algorithm>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define ROMFS_NONE             ((uint32_t) ~0)
+#define ROMFS_EMBEDDED_DIR     0x80000000
+#define ROMFS_BUCKET_SIZE      4
+#define ROMFS_MAX_SEED         0x100000
+#define ROMFS_MAX_INDEX_TRIES  8
+#define ROMFS_MAX_DEPTH        2048
+
+/// Hash state of a folded absolute path, must match romfs_path_hash in source/romfs_dev.cpp.
+struct embed_hash {
+    uint32_t h1;
+    uint32_t h2;
+};
+
+/// A dir (except the root) or file of the image.
+struct embed_key {
+    embed_hash hash;
+    uint32_t entry;
+};
+
+/// Perfect hash from the folded absolute path of every entry to its slot.
+struct embed_index {
+    std::vector<uint32_t> seeds;
+    std::vector<uint32_t> slots;
+};
+
+// Must match _romfsPathHashInit in source/romfs_dev.cpp.
+static embed_hash hashRoot(void) {
+    return {2166136261u, 5381};
+}
+
+// Must match _romfsPathHashAppend in source/romfs_dev.cpp.
+static embed_hash hashAppend(embed_hash hash, const uint8_t *name, uint32_t len) {
+    hash.h1 = (hash.h1 ^ '/') * 16777619u;
+    hash.h2 = (hash.h2 * 33) ^ '/';
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t c = normalizePathChar(name[i]);
+        hash.h1   = (hash.h1 ^ c) * 16777619u;
+        hash.h2   = (hash.h2 * 33) ^ c;
+    }
+    return hash;
+}
+
+// Must match _romfsEmbeddedSlot in source/romfs_dev.cpp.
+static uint32_t slotOf(const embed_hash &hash, uint32_t seed, uint32_t slotCount) {
+    uint32_t x = hash.h2 ^ seed;
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x % slotCount;
+}
+
+static bool readFile(const char *path, std::vector<uint8_t> &out) {
+    FILE *in = fopen(path, "rb");
+    if (in == nullptr) {
+        fprintf(stderr, "romfs_embed: can't open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    uint8_t buffer[0x10000];
+    size_t len;
+    while ((len = fread(buffer, 1, sizeof(buffer), in)) != 0) {
+        out.insert(out.end(), buffer, buffer + len);
+    }
+    bool ok = !ferror(in);
+    fclose(in);
+    if (!ok) {
+        fprintf(stderr, "romfs_embed: reading %s failed\n", path);
+    }
+    return ok;
+}
+
+struct embed_image {
+    const uint8_t *dirTable;
+    uint64_t dirTableSize;
+    const uint8_t *fileTable;
+    uint64_t fileTableSize;
+};
+
+static bool validEntry(uint64_t tableSize, const uint8_t *table, uint32_t off, uint32_t entrySize, uint32_t nameLenPos) {
+    return off + (uint64_t) entrySize <= tableSize && off + (uint64_t) entrySize + getBE32(table + off + nameLenPos) <= tableSize;
+}
+
+// Collects the children of the dir at dirOff, recursing into subdirectories.
+static bool collectKeys(const embed_image &image, uint32_t dirOff, embed_hash dirHash, uint32_t depth, std::vector<embed_key> &keys) {
+    if (depth > ROMFS_MAX_DEPTH) {
+        fprintf(stderr, "romfs_embed: directory tree is corrupt\n");
+        return false;
+    }
+    const uint8_t *dir = image.dirTable + dirOff;
+    for (uint32_t off = getBE32(dir + 0x0C); off != ROMFS_NONE;) {
+        if (!validEntry(image.fileTableSize, image.fileTable, off, sizeof(romfs_file), 0x1C)) {
+            fprintf(stderr, "romfs_embed: file table is corrupt\n");
+            return false;
+        }
+        const uint8_t *file = image.fileTable + off;
+        keys.push_back({hashAppend(dirHash, file + sizeof(romfs_file), getBE32(file + 0x1C)), off});
+        off = getBE32(file + 0x04);
+    }
+    for (uint32_t off = getBE32(dir + 0x08); off != ROMFS_NONE;) {
+        if (!validEntry(image.dirTableSize, image.dirTable, off, sizeof(romfs_dir), 0x14) || (off & ROMFS_EMBEDDED_DIR) != 0) {
+            fprintf(stderr, "romfs_embed: dir table is corrupt\n");
+            return false;
+        }
+        const uint8_t *child = image.dirTable + off;
+        embed_hash hash      = hashAppend(dirHash, child + sizeof(romfs_dir), getBE32(child + 0x14));
+        keys.push_back({hash, ROMFS_EMBEDDED_DIR | off});
+        if (!collectKeys(image, off, hash, depth + 1, keys)) {
+            return false;
+        }
+        off = getBE32(child + 0x04);
+    }
+    return true;
+}
+
+static bool readKeys(const std::vector<uint8_t> &data, std::vector<embed_key> &keys) {
+    if (data.size() < sizeof(romfs_header) || memcmp(data.data(), "WUHB", 4) != 0 || getBE32(data.data() + 4) != sizeof(romfs_header)) {
+        fprintf(stderr, "romfs_embed: not a WUHB image\n");
+        return false;
+    }
+    embed_image image;
+    uint64_t dirTableOff  = getBE64(data.data() + 0x18);
+    image.dirTableSize    = getBE64(data.data() + 0x20);
+    uint64_t fileTableOff = getBE64(data.data() + 0x38);
+    image.fileTableSize   = getBE64(data.data() + 0x40);
+    if (dirTableOff > data.size() || image.dirTableSize > data.size() - dirTableOff ||
+        fileTableOff > data.size() || image.fileTableSize > data.size() - fileTableOff ||
+        !validEntry(image.dirTableSize, data.data() + dirTableOff, 0, sizeof(romfs_dir), 0x14)) {
+        fprintf(stderr, "romfs_embed: image is truncated\n");
+        return false;
+    }
+    image.dirTable  = data.data() + dirTableOff;
+    image.fileTable = data.data() + fileTableOff;
+    return collectKeys(image, 0, hashRoot(), 0, keys);
+}
+
+// Hash and displace: buckets are placed largest first, each with the first seed that moves all its keys to free slots.
+static bool buildIndex(const std::vector<embed_key> &keys, uint32_t bucketCount, uint32_t slotCount, embed_index &index) {
+    std::vector<std::vector<const embed_key *>> buckets(bucketCount);
+    for (auto &key : keys) {
+        buckets[key.hash.h1 % bucketCount].push_back(&key);
+    }
+    std::vector<uint32_t> order(bucketCount);
+    for (uint32_t i = 0; i < bucketCount; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+
+    index.seeds.assign(bucketCount, 0);
+    index.slots.assign(slotCount, ROMFS_NONE);
+    std::vector<uint32_t> taken;
+    for (uint32_t bucket : order) {
+        if (buckets[bucket].empty()) {
+            break;
+        }
+        uint32_t seed = 0;
+        for (; seed < ROMFS_MAX_SEED; seed++) {
+            taken.clear();
+            bool fits = true;
+            for (auto *key : buckets[bucket]) {
+                uint32_t slot = slotOf(key->hash, seed, slotCount);
+                if (index.slots[slot] != ROMFS_NONE || std::find(taken.begin(), taken.end(), slot) != taken.end()) {
+                    fits = false;
+                    break;
+                }
+                taken.push_back(slot);
+            }
+            if (fits) {
+                break;
+            }
+        }
+        if (seed == ROMFS_MAX_SEED) {
+            return false;
+        }
+        index.seeds[bucket] = seed;
+        for (size_t i = 0; i < taken.size(); i++) {
+            index.slots[taken[i]] = buckets[bucket][i]->entry;
+        }
+    }
+    return true;
+}
+
+static void writeArray(FILE *out, const char *type, const std::string &name, const uint8_t *data, size_t size) {
+    fprintf(out, "alignas(64) static constexpr %s %s[] = {", type, name.c_str());
+    for (size_t i = 0; i < size; i++) {
+        fprintf(out, "%s0x%02x,", i % 16 == 0 ? "\n    " : " ", data[i]);
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+static void writeArray(FILE *out, const char *type, const std::string &name, const std::vector<uint32_t> &data) {
+    fprintf(out, "static constexpr %s %s[] = {", type, name.c_str());
+    for (size_t i = 0; i < data.size(); i++) {
+        fprintf(out, "%s0x%08x,", i % 8 == 0 ? "\n    " : " ", data[i]);
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+static bool writeSource(const char *outPath, const char *inPath, const std::string &symbol, const std::vector<uint8_t> &data, const embed_index *index) {
+    FILE *out = fopen(outPath, "w");
+    if (out == nullptr) {
+        fprintf(stderr, "romfs_embed: can't create %s: %s\n", outPath, strerror(errno));
+        return false;
+    }
+    fprintf(out, "// Generated by romfs_embed from %s, do not edit.\n"
+                 "// Declare it with extern const romfs_embedded %s; and mount it with romfsMountEmbedded.\n"
+                 "#include <romfs_dev.h>\n\n",
+            inPath, symbol.c_str());
+    writeArray(out, "uint8_t", symbol + "_data", data.data(), data.size());
+    if (index != nullptr) {
+        writeArray(out, "uint32_t", symbol + "_seeds", index->seeds);
+        writeArray(out, "uint32_t", symbol + "_slots", index->slots);
+        fprintf(out, "extern const romfs_embedded %s = {%s_data, sizeof(%s_data), %s_seeds, %zu, %s_slots, %zu};\n",
+                symbol.c_str(), symbol.c_str(), symbol.c_str(), symbol.c_str(), index->seeds.size(), symbol.c_str(), index->slots.size());
+    } else {
+        fprintf(out, "extern const romfs_embedded %s = {%s_data, sizeof(%s_data), nullptr, 0, nullptr, 0};\n",
+                symbol.c_str(), symbol.c_str(), symbol.c_str());
+    }
+    if (fclose(out) != 0) {
+        fprintf(stderr, "romfs_embed: writing %s failed\n", outPath);
+        remove(outPath);
+        return false;
+    }
+    return true;
+}
+
+static bool validSymbol(const char *name) {
+    if (!isalpha((uint8_t) name[0]) && name[0] != '_') {
+        return false;
+    }
+    for (const char *c = name; *c; c++) {
+        if (!isalnum((uint8_t) *c) && *c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: romfs_embed [-n symbol] [-v] <input.wuhb> <output.cpp>\n"
+                    "  -n  name of the romfs_embedded variable (default romfs_image)\n"
+                    "  -v  print statistics about the index\n"
+                    "Writes a C++ source file containing the image and a perfect hash index of its paths.\n");
+}
+
+int main(int argc, char **argv) {
+    const char *symbol = "romfs_image";
+    bool verbose       = false;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            symbol = argv[++i];
+            if (!validSymbol(symbol)) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (argc - i != 2) {
+        usage();
+        return 1;
+    }
+    const char *inPath  = argv[i];
+    const char *outPath = argv[i + 1];
+
+    std::vector<uint8_t> data;
+    std::vector<embed_key> keys;
+    if (!readFile(inPath, data) || !readKeys(data, keys)) {
+        return 1;
+    }
+
+    // two paths with the same hash can never get separate slots
+    bool indexed = !keys.empty();
+    std::set<std::pair<uint32_t, uint32_t>> seen;
+    for (auto &key : keys) {
+        if (!seen.insert({key.hash.h1, key.hash.h2}).second) {
+            fprintf(stderr, "romfs_embed: warning: path hash collision, paths are looked up through the hash tables\n");
+            indexed = false;
+            break;
+        }
+    }
+
+    // a little slack keeps the seed search short; retries spread the keys over other buckets
+    embed_index index;
+    uint32_t bucketCount = std::max<uint32_t>(1, (keys.size() + ROMFS_BUCKET_SIZE - 1) / ROMFS_BUCKET_SIZE);
+    uint32_t slotCount   = keys.size() + keys.size() / 8 + 1;
+    int tries            = 0;
+    while (indexed && !buildIndex(keys, bucketCount, slotCount, index)) {
+        if (++tries == ROMFS_MAX_INDEX_TRIES) {
+            fprintf(stderr, "romfs_embed: warning: no perfect hash found, paths are looked up through the hash tables\n");
+            indexed = false;
+            break;
+        }
+        bucketCount += bucketCount / 4 + 1;
+        slotCount += slotCount / 8 + 1;
+    }
+
+    if (!writeSource(outPath, inPath, symbol, data, indexed ? &index : nullptr)) {
+        return 1;
+    }
+    if (verbose) {
+        printf("%zu entries, image size %zu bytes\n", keys.size(), data.size());
+        if (indexed) {
+            printf("index: %zu buckets, %zu slots, %zu bytes\n", index.seeds.size(), index.slots.size(), 4 * (index.seeds.size() + index.slots.size()));
+        }
+    }
+    return 0;
+}
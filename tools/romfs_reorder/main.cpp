@@ -0,0 +1,295 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "romfs_dev.h"
+#include "romfs_tool.h"
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#define ROMFS_DEFAULT_ALIGN   0x40
+#define ROMFS_COPY_BLOCK_SIZE 0x100000
+#define ROMFS_UNUSED          UINT64_MAX
+
+/// File table entry of the input image.
+struct reorder_file {
+    uint32_t off;
+    std::string name;
+    uint64_t dataOff;
+    uint64_t dataSize;
+};
+
+/// Range of file data, shared by entries with the same dataOff.
+struct reorder_blob {
+    uint64_t oldOff;
+    uint64_t size;
+    uint64_t newOff;
+    uint64_t firstRead;
+    uint64_t firstOpen;
+};
+
+static void putBE64(uint8_t *p, uint64_t value) {
+    for (int i = 7; i >= 0; i--, value >>= 8) {
+        p[i] = (uint8_t) value;
+    }
+}
+
+static bool readAt(FILE *in, uint64_t offset, void *buffer, uint64_t size) {
+    return fseeko(in, offset, SEEK_SET) == 0 && fread(buffer, 1, size, in) == size;
+}
+
+static bool readImage(FILE *in, std::vector<uint8_t> &meta, romfs_header *header, std::vector<reorder_file> &files) {
+    uint8_t raw[sizeof(romfs_header)];
+    if (!readAt(in, 0, raw, sizeof(raw)) || memcmp(raw, "WUHB", 4) != 0 || getBE32(raw + 4) != sizeof(romfs_header)) {
+        fprintf(stderr, "romfs_reorder: not a WUHB image\n");
+        return false;
+    }
+    header->dirHashTableOff   = getBE64(raw + 0x08);
+    header->dirHashTableSize  = getBE64(raw + 0x10);
+    header->dirTableOff       = getBE64(raw + 0x18);
+    header->dirTableSize      = getBE64(raw + 0x20);
+    header->fileHashTableOff  = getBE64(raw + 0x28);
+    header->fileHashTableSize = getBE64(raw + 0x30);
+    header->fileTableOff      = getBE64(raw + 0x38);
+    header->fileTableSize     = getBE64(raw + 0x40);
+    header->fileDataOff       = getBE64(raw + 0x48);
+
+    // only the data region is rewritten, everything in front of it is copied with patched offsets
+    if (header->dirHashTableOff + header->dirHashTableSize > header->fileDataOff ||
+        header->dirTableOff + header->dirTableSize > header->fileDataOff ||
+        header->fileHashTableOff + header->fileHashTableSize > header->fileDataOff ||
+        header->fileTableOff + header->fileTableSize > header->fileDataOff) {
+        fprintf(stderr, "romfs_reorder: metadata after the file data is not supported\n");
+        return false;
+    }
+    meta.resize(header->fileDataOff);
+    if (!readAt(in, 0, meta.data(), meta.size())) {
+        fprintf(stderr, "romfs_reorder: can't read the metadata\n");
+        return false;
+    }
+
+    const uint8_t *table = meta.data() + header->fileTableOff;
+    for (uint64_t off = 0; off + sizeof(romfs_file) <= header->fileTableSize;) {
+        uint32_t nameLen = getBE32(table + off + 0x1C);
+        if (off + sizeof(romfs_file) + nameLen > header->fileTableSize) {
+            fprintf(stderr, "romfs_reorder: file table is corrupt\n");
+            return false;
+        }
+        reorder_file file;
+        file.off      = off;
+        file.dataOff  = getBE64(table + off + 0x08);
+        file.dataSize = getBE64(table + off + 0x10);
+        file.name.assign((const char *) table + off + sizeof(romfs_file), nameLen);
+        files.push_back(file);
+        off += sizeof(romfs_file) + alignUp(nameLen, 4);
+    }
+    return true;
+}
+
+// Records the first open and first read of every blob, in the order they appear in the trace.
+static bool readTrace(const char *path, std::vector<reorder_file> &files, std::vector<reorder_blob> &blobs, std::map<uint32_t, size_t> &blobOf) {
+    FILE *trace = fopen(path, "r");
+    if (trace == nullptr) {
+        fprintf(stderr, "romfs_reorder: can't open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    std::map<uint32_t, reorder_file *> byOff;
+    for (auto &file : files) {
+        byOff[file.off] = &file;
+    }
+
+    char line[4096];
+    uint64_t event = 0;
+    uint32_t lineNo = 0;
+    bool ok         = true;
+    while (ok && fgets(line, sizeof(line), trace) != nullptr) {
+        lineNo++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+
+        uint32_t fileOff;
+        int pathStart = 0;
+        bool isOpen   = sscanf(line, "open %u %n", &fileOff, &pathStart) == 1 && pathStart != 0;
+        unsigned long long pos;
+        unsigned int size;
+        if (!isOpen && sscanf(line, "read %u %llu %u", &fileOff, &pos, &size) != 3) {
+            fprintf(stderr, "romfs_reorder: %s:%u: unknown line\n", path, lineNo);
+            ok = false;
+            break;
+        }
+
+        auto it = byOff.find(fileOff);
+        if (it == byOff.end()) {
+            fprintf(stderr, "romfs_reorder: %s:%u: no file at %u, was the trace recorded with this image?\n", path, lineNo, fileOff);
+            ok = false;
+            break;
+        }
+        if (isOpen) {
+            const char *name = strrchr(line + pathStart, '/');
+            name             = name ? name + 1 : line + pathStart;
+            if (!sameNameFolded(it->second->name, name)) {
+                fprintf(stderr, "romfs_reorder: %s:%u: %s doesn't match %s, was the trace recorded with this image?\n", path, lineNo, line + pathStart, it->second->name.c_str());
+                ok = false;
+                break;
+            }
+        }
+
+        reorder_blob &blob = blobs[blobOf[fileOff]];
+        uint64_t &first    = isOpen ? blob.firstOpen : blob.firstRead;
+        if (first == ROMFS_UNUSED) {
+            first = event;
+        }
+        event++;
+    }
+    fclose(trace);
+    return ok;
+}
+
+static bool copyRange(FILE *in, FILE *out, uint64_t offset, uint64_t size) {
+    std::vector<uint8_t> buffer(ROMFS_COPY_BLOCK_SIZE);
+    if (fseeko(in, offset, SEEK_SET) != 0) {
+        return false;
+    }
+    while (size != 0) {
+        size_t len = std::min<uint64_t>(size, buffer.size());
+        if (fread(buffer.data(), 1, len, in) != len || fwrite(buffer.data(), 1, len, out) != len) {
+            return false;
+        }
+        size -= len;
+    }
+    return true;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: romfs_reorder [-a alignment] [-v] <trace> <input.wuhb> <output.wuhb>\n"
+                    "  -a  alignment of file data in bytes, a power of two up to 4096 (default 64)\n"
+                    "  -v  print how many data ranges were moved to the front\n"
+                    "Stores file data in the order it was first read in a trace recorded with romfsStartTrace.\n");
+}
+
+int main(int argc, char **argv) {
+    uint64_t alignment = ROMFS_DEFAULT_ALIGN;
+    bool verbose       = false;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            char *end;
+            alignment = strtoull(argv[++i], &end, 0);
+            if (*end || alignment == 0 || alignment > 0x1000 || (alignment & (alignment - 1)) != 0) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (argc - i != 3) {
+        usage();
+        return 1;
+    }
+    const char *tracePath = argv[i];
+    const char *inPath    = argv[i + 1];
+    const char *outPath   = argv[i + 2];
+
+    FILE *in = fopen(inPath, "rb");
+    if (in == nullptr) {
+        fprintf(stderr, "romfs_reorder: can't open %s: %s\n", inPath, strerror(errno));
+        return 1;
+    }
+
+    std::vector<uint8_t> meta;
+    romfs_header header;
+    std::vector<reorder_file> files;
+    if (!readImage(in, meta, &header, files)) {
+        fclose(in);
+        return 1;
+    }
+
+    // files sharing their data keep sharing it
+    std::vector<reorder_blob> blobs;
+    std::map<uint64_t, size_t> blobAt;
+    std::map<uint32_t, size_t> blobOf;
+    for (auto &file : files) {
+        auto it = blobAt.find(file.dataOff);
+        if (it == blobAt.end()) {
+            it = blobAt.emplace(file.dataOff, blobs.size()).first;
+            blobs.push_back({file.dataOff, 0, 0, ROMFS_UNUSED, ROMFS_UNUSED});
+        }
+        blobs[it->second].size = std::max(blobs[it->second].size, file.dataSize);
+        blobOf[file.off]       = it->second;
+    }
+
+    if (!readTrace(tracePath, files, blobs, blobOf)) {
+        fclose(in);
+        return 1;
+    }
+
+    // read data first, then data that was only opened, then everything else in its old order
+    std::vector<reorder_blob *> order;
+    for (auto &blob : blobs) {
+        order.push_back(&blob);
+    }
+    std::stable_sort(order.begin(), order.end(), [](const reorder_blob *a, const reorder_blob *b) {
+        if (a->firstRead != b->firstRead) {
+            return a->firstRead < b->firstRead;
+        }
+        if (a->firstOpen != b->firstOpen) {
+            return a->firstOpen < b->firstOpen;
+        }
+        return a->oldOff < b->oldOff;
+    });
+
+    uint64_t dataOff = 0;
+    uint32_t traced  = 0;
+    for (auto *blob : order) {
+        blob->newOff = alignUp(dataOff, alignment);
+        dataOff      = blob->newOff + blob->size;
+        if (blob->firstRead != ROMFS_UNUSED || blob->firstOpen != ROMFS_UNUSED) {
+            traced++;
+        }
+    }
+
+    // the metadata stays as is apart from dataOff
+    for (auto &file : files) {
+        putBE64(meta.data() + header.fileTableOff + file.off + 0x08, blobs[blobOf[file.off]].newOff);
+    }
+
+    FILE *out = fopen(outPath, "wb");
+    if (out == nullptr) {
+        fprintf(stderr, "romfs_reorder: can't create %s: %s\n", outPath, strerror(errno));
+        fclose(in);
+        return 1;
+    }
+    bool ok          = fwrite(meta.data(), 1, meta.size(), out) == meta.size();
+    uint64_t written = 0;
+    static const uint8_t padding[0x1000] = {};
+    for (auto *blob : order) {
+        if (!ok) {
+            break;
+        }
+        uint64_t pad = blob->newOff - written;
+        ok           = fwrite(padding, 1, pad, out) == pad && copyRange(in, out, header.fileDataOff + blob->oldOff, blob->size);
+        written      = blob->newOff + blob->size;
+    }
+    fclose(in);
+    if (fclose(out) != 0 || !ok) {
+        fprintf(stderr, "romfs_reorder: writing %s failed\n", outPath);
+        remove(outPath);
+        return 1;
+    }
+
+    if (verbose) {
+        printf("%u of %zu data ranges moved to the front in first-access order\n", traced, blobs.size());
+    }
+    return 0;
+}